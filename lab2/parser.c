@@ -5,12 +5,19 @@
 #include <stdlib.h>
 #include <string.h>
 
-struct parser {
-	char *buffer;
-	uint32_t size;
-	uint32_t capacity;
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+enum {
+	/** Number of slots in the plan cache, a power of 2. */
+	PLAN_CACHE_SIZE = 256,
+	/** Longer lines are not cached. */
+	PLAN_TEXT_MAX = 4096,
 };
 
+struct plan;
+
 enum token_type {
 	TOKEN_TYPE_NONE,
 	TOKEN_TYPE_STR,
@@ -21,74 +28,455 @@ enum token_type {
 	TOKEN_TYPE_OUT_NEW,
 	TOKEN_TYPE_OUT_APPEND,
 	TOKEN_TYPE_BACKGROUND,
+	/** '<<', followed by the here-document delimiter. */
+	TOKEN_TYPE_HEREDOC,
+	/** '<(cmd)', the data is the command text. */
+	TOKEN_TYPE_SUBST,
 };
 
+/**
+ * Token data is built right at the top of the line's arena. It becomes an
+ * arena allocation only when committed, otherwise the next token just
+ * overwrites it. A token can be cut by the end of the fed data, then its
+ * type stays TOKEN_TYPE_NONE and the next call goes on with it.
+ */
 struct token {
 	enum token_type type;
+	struct line_arena *arena;
 	char *data;
 	uint32_t size;
 	uint32_t capacity;
+	/** Open quote, '#' in a comment, 0 outside of them. */
+	char quote;
+	/** Depth of parentheses in '<(cmd)', 0 outside of it. */
+	uint32_t depth;
 };
 
-static char *
-token_strdup(const struct token *t)
+/** Here-document which body is not read yet. */
+struct pending_heredoc {
+	struct command *cmd;
+	const char *delimiter;
+	struct pending_heredoc *next;
+};
+
+/** What is expected next in the line being parsed. */
+enum line_stage {
+	/** Commands with arguments and operators between them. */
+	LINE_STAGE_WORDS,
+	/** The delimiter after '<<'. */
+	LINE_STAGE_HEREDOC_DELIMITER,
+	/** The file name after '>' or '>>'. */
+	LINE_STAGE_OUT_FILE,
+	/** '&' or the end of the line, after the output redirect. */
+	LINE_STAGE_AFTER_OUT,
+	/** The end of the line, after '&'. */
+	LINE_STAGE_AFTER_BACKGROUND,
+	/** The line is tokenized, here-document bodies follow it. */
+	LINE_STAGE_HEREDOC_BODIES,
+	/** The line has an error, its tokens are skipped up to its end. */
+	LINE_STAGE_SKIP,
+};
+
+/**
+ * The line being parsed. When its text is not complete yet, the line is
+ * kept with the token it stopped in, and the next call goes on from there.
+ * So each byte is tokenized once, however small the fed parts are. Offsets
+ * are from the parser's position, the buffer can move between feeds.
+ */
+struct line_state {
+	/** NULL if no line is started. */
+	struct command_line *line;
+	struct token token;
+	enum line_stage stage;
+	/** Error to return at the end of a skipped line. */
+	enum parser_error error;
+	/** Bytes already tokenized. */
+	uint32_t scanned;
+	/** Where the current token starts, with the spaces before it. */
+	uint32_t token_begin;
+	struct pending_heredoc *heredocs;
+	struct pending_heredoc *last_heredoc;
+	/** Here-document which body is read, the body and its line starts. */
+	struct pending_heredoc *heredoc;
+	uint32_t body;
+	uint32_t body_line;
+	/**
+	 * Size and hash of the plan cache key, the text up to the first new
+	 * line. The size is 0 while there is no new line in the first
+	 * key_scanned bytes.
+	 */
+	uint32_t key_size;
+	uint32_t key_scanned;
+	uint32_t hash;
+	/** The plan in the key's slot is already compared with the text. */
+	bool is_plan_checked;
+};
+
+struct parser {
+	char *buffer;
+	/** Offset of the first not consumed byte in the buffer. */
+	uint32_t pos;
+	uint32_t size;
+	uint32_t capacity;
+	/** Arenas of deleted lines, ready for reuse. */
+	struct line_arena *free_arenas;
+	/** How many popped lines are not deleted yet. */
+	uint32_t arenas_in_use;
+	/** parser_delete() was called while some lines were alive. */
+	bool is_deleted;
+	/**
+	 * Cache of parsed lines, direct mapped by the hash of the line's text.
+	 * A line is cached when it is seen the second time, so scripts
+	 * without repeats don't pay for keeping their lines.
+	 */
+	struct plan *plans[PLAN_CACHE_SIZE];
+	/** Hashes of the lines seen once, by slot. */
+	uint32_t seen_hashes[PLAN_CACHE_SIZE];
+	struct parser_stats stats;
+	/** The line being parsed, not complete yet. */
+	struct line_state current;
+};
+
+enum {
+	ARENA_CHUNK_SIZE = 4096,
+	ARENA_ALIGN = sizeof(void *),
+};
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	uint32_t size;
+	uint32_t used;
+	char data[];
+};
+
+/**
+ * All the memory of one command line: the line itself, its exprs, argv
+ * arrays and strings. Chunks are kept on reset, so once they have grown to
+ * the size of typical lines, parsing doesn't allocate anything.
+ */
+struct line_arena {
+	struct parser *owner;
+	struct arena_chunk *head;
+	/** Chunk the allocations are taken from. Next ones are unused. */
+	struct arena_chunk *current;
+	struct line_arena *next_free;
+	/** Plan owning the arena if the line is cached, NULL otherwise. */
+	struct plan *plan;
+};
+
+/**
+ * A parsed line kept for reuse. It is immutable and shared by all the
+ * popped copies of the same text, which is compared in full on lookup.
+ */
+struct plan {
+	uint32_t hash;
+	/** The hash is of the text up to the first new line, inclusive. */
+	uint32_t key_size;
+	/** The whole text the line was parsed from. Can be multi-line. */
+	uint32_t text_size;
+	/** Popped and not deleted lines using the plan. */
+	uint32_t refs;
+	struct command_line *line;
+	char text[];
+};
+
+static struct arena_chunk *
+arena_next_chunk(struct line_arena *a, uint32_t size)
 {
-	assert(t->type == TOKEN_TYPE_STR);
-	assert(t->size > 0);
-	char *res = malloc(t->size + 1);
-	memcpy(res, t->data, t->size);
-	res[t->size] = 0;
-	return res;
+	struct arena_chunk *c = a->current->next;
+	if (c == NULL || c->size < size) {
+		uint32_t new_size = a->current->size * 2;
+		if (new_size < size)
+			new_size = size;
+		struct arena_chunk *n = malloc(sizeof(*n) + new_size);
+		n->size = new_size;
+		/* A too small unused chunk is just skipped. */
+		n->next = c;
+		a->current->next = n;
+		c = n;
+	}
+	c->used = 0;
+	a->current = c;
+	return c;
+}
+
+static void *
+arena_alloc(struct line_arena *a, uint32_t size)
+{
+	struct arena_chunk *c = a->current;
+	uint32_t offset = (c->used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (offset > c->size || c->size - offset < size) {
+		c = arena_next_chunk(a, size);
+		offset = 0;
+	}
+	c->used = offset + size;
+	return c->data + offset;
 }
 
 static void
-token_append(struct token *t, char c)
+arena_reset(struct line_arena *a)
+{
+	a->current = a->head;
+	a->head->used = 0;
+}
+
+static void
+arena_delete(struct line_arena *a)
 {
-	if (t->size == t->capacity) {
-		t->capacity = (t->capacity + 1) * 2;
-		t->data = realloc(t->data, sizeof(*t->data) * t->capacity);
+	struct arena_chunk *c = a->head;
+	while (c != NULL) {
+		struct arena_chunk *next = c->next;
+		free(c);
+		c = next;
+	}
+	free(a);
+}
+
+static struct line_arena *
+parser_take_arena(struct parser *p)
+{
+	struct line_arena *a = p->free_arenas;
+	if (a != NULL) {
+		p->free_arenas = a->next_free;
 	} else {
-		assert(t->size < t->capacity);
+		a = malloc(sizeof(*a));
+		a->owner = p;
+		a->plan = NULL;
+		a->head = malloc(sizeof(*a->head) + ARENA_CHUNK_SIZE);
+		a->head->next = NULL;
+		a->head->size = ARENA_CHUNK_SIZE;
+		arena_reset(a);
 	}
+	++p->arenas_in_use;
+	return a;
+}
+
+static void
+plan_delete(struct plan *plan)
+{
+	assert(plan->refs == 0);
+	arena_delete(plan->line->arena);
+	free(plan);
+}
+
+static void
+parser_free(struct parser *p)
+{
+	for (uint32_t i = 0; i < PLAN_CACHE_SIZE; ++i) {
+		if (p->plans[i] != NULL)
+			plan_delete(p->plans[i]);
+	}
+	while (p->free_arenas != NULL) {
+		struct line_arena *a = p->free_arenas;
+		p->free_arenas = a->next_free;
+		arena_delete(a);
+	}
+	free(p->buffer);
+	free(p);
+}
+
+static char *
+token_commit(struct token *t)
+{
+	assert(t->type == TOKEN_TYPE_STR || t->type == TOKEN_TYPE_SUBST);
+	assert(t->size > 0 || t->type == TOKEN_TYPE_SUBST);
+	assert(t->size < t->capacity);
+	struct arena_chunk *c = t->arena->current;
+	assert(t->data >= c->data && t->data + t->capacity == c->data + c->size);
+	t->data[t->size] = 0;
+	c->used = t->data - c->data + t->size + 1;
+	return t->data;
+}
+
+static void
+token_reserve(struct token *t, uint32_t size)
+{
+	/* Keep one byte for the terminating zero. */
+	if (t->capacity - t->size > size)
+		return;
+	struct arena_chunk *c = arena_next_chunk(t->arena,
+						 (t->size + size + 1) * 2);
+	memcpy(c->data, t->data, t->size);
+	t->data = c->data;
+	t->capacity = c->size;
+}
+
+static void
+token_append(struct token *t, char c)
+{
+	token_reserve(t, 1);
 	t->data[t->size++] = c;
 }
 
+static void
+token_append_run(struct token *t, const char *data, uint32_t size)
+{
+	token_reserve(t, size);
+	memcpy(t->data + t->size, data, size);
+	t->size += size;
+}
+
 static void
 token_reset(struct token *t)
 {
+	struct arena_chunk *c = t->arena->current;
 	t->size = 0;
 	t->type = TOKEN_TYPE_NONE;
+	t->quote = 0;
+	t->depth = 0;
+	t->data = c->data + c->used;
+	t->capacity = c->size - c->used;
 }
 
 static void
-command_append_arg(struct command *cmd, char *arg)
+command_append_arg(struct line_arena *a, struct command *cmd, char *arg)
 {
 	if (cmd->arg_count == cmd->arg_capacity) {
-		cmd->arg_capacity = (cmd->arg_capacity + 1) * 2;
-		cmd->args = realloc(cmd->args, sizeof(*cmd->args) * cmd->arg_capacity);
+		/* Old argv is left in the arena, it dies with the line. */
+		uint32_t capacity = cmd->arg_capacity * 2;
+		char **argv = arena_alloc(a, sizeof(*argv) * (capacity + 2));
+		memcpy(argv, cmd->argv, sizeof(*argv) * (cmd->arg_count + 1));
+		cmd->argv = argv;
+		cmd->args = argv + 1;
+		cmd->arg_capacity = capacity;
 	} else {
 		assert(cmd->arg_count < cmd->arg_capacity);
 	}
 	cmd->args[cmd->arg_count++] = arg;
+	cmd->args[cmd->arg_count] = NULL;
+}
+
+static void
+command_append_subst(struct line_arena *a, struct command *cmd,
+		     uint32_t index)
+{
+	/* Few commands have them, so the array grows by one. */
+	uint32_t *substs = arena_alloc(a, sizeof(*substs) *
+				       (cmd->subst_count + 1));
+	if (cmd->subst_count > 0)
+		memcpy(substs, cmd->substs,
+		       sizeof(*substs) * cmd->subst_count);
+	substs[cmd->subst_count++] = index;
+	cmd->substs = substs;
+}
+
+static void
+command_append_expansion(struct line_arena *a, struct command *cmd,
+			 uint32_t index, const char *source)
+{
+	struct word_expansion *expansions =
+		arena_alloc(a, sizeof(*expansions) *
+			       (cmd->expansion_count + 1));
+	if (cmd->expansion_count > 0)
+		memcpy(expansions, cmd->expansions,
+		       sizeof(*expansions) * cmd->expansion_count);
+	expansions[cmd->expansion_count].index = index;
+	expansions[cmd->expansion_count].source = source;
+	++cmd->expansion_count;
+	cmd->expansions = expansions;
+}
+
+/**
+ * Read the bodies of the line's here-documents, which follow the line one
+ * by one, each up to the line equal to its delimiter. Begin is the start of
+ * the line's text, pos is where the previous call stopped. Returns where
+ * this one stopped, the bodies are complete when s->heredoc is NULL.
+ */
+static const char *
+parse_heredocs(struct line_state *s, const char *begin, const char *pos,
+	       const char *end)
+{
+	struct line_arena *a = s->line->arena;
+	while (s->heredoc != NULL && pos < end) {
+		const char *nl = memchr(pos, '\n', end - pos);
+		if (nl == NULL)
+			return end;
+		const char *line = begin + s->body_line;
+		pos = nl + 1;
+		s->body_line = pos - begin;
+		struct pending_heredoc *h = s->heredoc;
+		size_t delimiter_size = strlen(h->delimiter);
+		if ((size_t)(nl - line) != delimiter_size ||
+		    memcmp(line, h->delimiter, delimiter_size) != 0)
+			continue;
+		uint32_t size = line - (begin + s->body);
+		char *data = arena_alloc(a, size + 1);
+		memcpy(data, begin + s->body, size);
+		data[size] = 0;
+		h->cmd->heredoc = data;
+		h->cmd->heredoc_size = size;
+		s->heredoc = h->next;
+		s->body = s->body_line;
+	}
+	return pos;
+}
+
+static struct expr *
+expr_new(struct line_arena *a, enum expr_type type)
+{
+	struct expr *e = arena_alloc(a, sizeof(*e));
+	memset(e, 0, sizeof(*e));
+	e->type = type;
+	return e;
+}
+
+static struct expr *
+expr_new_command(struct line_arena *a, char *exe)
+{
+	enum {
+		/* Typical commands have just a few arguments. */
+		INITIAL_ARG_CAPACITY = 6,
+	};
+	struct expr *e = expr_new(a, EXPR_TYPE_COMMAND);
+	struct command *cmd = &e->cmd;
+	cmd->argv = arena_alloc(a, sizeof(*cmd->argv) *
+				(INITIAL_ARG_CAPACITY + 2));
+	cmd->argv[0] = exe;
+	cmd->argv[1] = NULL;
+	cmd->exe = exe;
+	cmd->args = cmd->argv + 1;
+	cmd->arg_capacity = INITIAL_ARG_CAPACITY;
+	return e;
 }
 
 void
 command_line_delete(struct command_line *line)
 {
-	while (line->head != NULL) {
-		struct expr *e = line->head;
-		if (e->type == EXPR_TYPE_COMMAND) {
-			struct command *cmd = &e->cmd;
-			free(cmd->exe);
-			for (uint32_t i = 0; i < cmd->arg_count; ++i)
-				free(cmd->args[i]);
-			free(cmd->args);
-		}
-		line->head = e->next;
-		free(e);
+	struct line_arena *a = line->arena;
+	struct parser *p = a->owner;
+	if (a->plan != NULL) {
+		/* Cached lines live as long as the parser. */
+		--a->plan->refs;
+	} else {
+		arena_reset(a);
+		a->next_free = p->free_arenas;
+		p->free_arenas = a;
 	}
-	free(line->out_file);
-	free(line);
+	if (--p->arenas_in_use == 0 && p->is_deleted)
+		parser_free(p);
+}
+
+/**
+ * 'time' in front of a line is a keyword, like in bash. It is removed from
+ * the first command, unless it is the only word there.
+ */
+static void
+line_strip_time(struct command_line *line)
+{
+	struct command *cmd = &line->head->cmd;
+	if (line->head->type != EXPR_TYPE_COMMAND || cmd->arg_count == 0 ||
+	    strcmp(cmd->exe, "time") != 0)
+		return;
+	++cmd->argv;
+	++cmd->args;
+	--cmd->arg_count;
+	--cmd->arg_capacity;
+	cmd->exe = cmd->argv[0];
+	for (uint32_t i = 0; i < cmd->subst_count; ++i)
+		--cmd->substs[i];
+	for (uint32_t i = 0; i < cmd->expansion_count; ++i)
+		--cmd->expansions[i].index;
+	line->is_timed = true;
 }
 
 static void
@@ -111,6 +499,16 @@ void
 parser_feed(struct parser *p, const char *str, uint32_t len)
 {
 	uint32_t cap = p->capacity - p->size;
+	if (cap < len && p->pos > 0) {
+		/*
+		 * Consumed bytes are dropped only here, so each byte is moved
+		 * at most once per feed instead of once per popped line.
+		 */
+		memmove(p->buffer, p->buffer + p->pos, p->size - p->pos);
+		p->size -= p->pos;
+		p->pos = 0;
+		cap = p->capacity - p->size;
+	}
 	if (cap < len) {
 		uint32_t new_capacity = (p->capacity + 1) * 2;
 		if (new_capacity - p->size < len)
@@ -126,30 +524,186 @@ parser_feed(struct parser *p, const char *str, uint32_t len)
 static void
 parser_consume(struct parser *p, uint32_t size)
 {
-	assert(p->size >= size);
-	if (size == p->size) {
+	assert(p->size - p->pos >= size);
+	p->pos += size;
+	if (p->pos == p->size) {
+		p->pos = 0;
 		p->size = 0;
-		return;
 	}
-	memmove(p->buffer, p->buffer + size, p->size - size);
-	p->size -= size;
 }
 
+/**
+ * Chars which have a meaning for the tokenizer, depending on the quotes the
+ * token is in. Everything else is a plain char which just goes to the token.
+ */
+struct scan_stops {
+	const char *chars;
+	int count;
+	/** Same chars as a lookup table, for short runs and tails. */
+	bool table[256];
+};
+
+enum {
+	SCAN_STOPS_MAX = 12,
+};
+
+static const struct scan_stops word_stops = {
+	" \t\r\n'\"\\&|><#", 12,
+	{[' '] = true, ['\t'] = true, ['\r'] = true, ['\n'] = true,
+	 ['\''] = true, ['"'] = true, ['\\'] = true, ['&'] = true,
+	 ['|'] = true, ['>'] = true, ['<'] = true, ['#'] = true},
+};
+static const struct scan_stops double_quote_stops = {
+	"\"\\", 2, {['"'] = true, ['\\'] = true},
+};
+static const struct scan_stops single_quote_stops = {
+	"'", 1, {['\''] = true},
+};
+/** Chars which can make a word expand, if they are not quoted. */
+static const struct scan_stops expansion_stops = {
+	"$*?[", 4, {['$'] = true, ['*'] = true, ['?'] = true, ['['] = true},
+};
+
+static const char *
+scan_run_scalar(const char *pos, const char *end,
+		const struct scan_stops *stops)
+{
+	while (pos < end && !stops->table[(unsigned char)*pos])
+		++pos;
+	return pos;
+}
+
+#if defined(__x86_64__)
+
+static const char *
+scan_run_sse2(const char *pos, const char *end, const struct scan_stops *stops)
+{
+	__m128i needles[SCAN_STOPS_MAX];
+	for (int i = 0; i < stops->count; ++i)
+		needles[i] = _mm_set1_epi8(stops->chars[i]);
+	while (end - pos >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)pos);
+		__m128i m = _mm_cmpeq_epi8(v, needles[0]);
+		for (int i = 1; i < stops->count; ++i)
+			m = _mm_or_si128(m, _mm_cmpeq_epi8(v, needles[i]));
+		uint32_t bits = _mm_movemask_epi8(m);
+		if (bits != 0)
+			return pos + __builtin_ctz(bits);
+		pos += 16;
+	}
+	return scan_run_scalar(pos, end, stops);
+}
+
+__attribute__((target("avx2")))
+static const char *
+scan_run_avx2(const char *pos, const char *end, const struct scan_stops *stops)
+{
+	__m256i needles[SCAN_STOPS_MAX];
+	for (int i = 0; i < stops->count; ++i)
+		needles[i] = _mm256_set1_epi8(stops->chars[i]);
+	while (end - pos >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)pos);
+		__m256i m = _mm256_cmpeq_epi8(v, needles[0]);
+		for (int i = 1; i < stops->count; ++i)
+			m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, needles[i]));
+		uint32_t bits = _mm256_movemask_epi8(m);
+		if (bits != 0)
+			return pos + __builtin_ctz(bits);
+		pos += 32;
+	}
+	return scan_run_sse2(pos, end, stops);
+}
+
+#endif
+
+/**
+ * Find the end of a run of plain chars. Runs long enough for vectors are
+ * classified by 32 (AVX2) or 16 (SSE2) bytes at once.
+ */
+static const char *
+scan_run(const char *pos, const char *end, const struct scan_stops *stops)
+{
+#if defined(__x86_64__)
+	/*
+	 * Most of runs are short words, vectors don't pay off for them. Only
+	 * the runs longer than that go to the vector scanners.
+	 */
+	const char *short_end = end - pos > 16 ? pos + 16 : end;
+	pos = scan_run_scalar(pos, short_end, stops);
+	if (pos < short_end || pos == end)
+		return pos;
+	if (end - pos >= 32 && __builtin_cpu_supports("avx2"))
+		return scan_run_avx2(pos, end, stops);
+	return scan_run_sse2(pos, end, stops);
+#else
+	return scan_run_scalar(pos, end, stops);
+#endif
+}
+
+/**
+ * Text of '<(cmd)' up to the matching ')'. Quotes and nested parentheses
+ * are skipped, the text is parsed as a line when the command is run.
+ * Returns the number of bytes taken, the token is SUBST if it is complete.
+ */
 static uint32_t
-parse_token(const char *pos, const char *end, struct token *out)
+parse_subst(const char *pos, const char *end, struct token *out)
 {
-	token_reset(out);
 	const char *begin = pos;
-	while (pos < end) {
-		if (!isspace(*pos))
-			break;
-		if (*pos == '\n') {
-			out->type = TOKEN_TYPE_NEW_LINE;
+	for (; pos < end; ++pos) {
+		char c = *pos;
+		if (out->quote != 0) {
+			if (c == out->quote) {
+				out->quote = 0;
+			} else if (c == '\\' && out->quote == '"') {
+				if (pos + 1 == end)
+					break;
+				++pos;
+			}
+		} else if (c == '\'' || c == '"') {
+			out->quote = c;
+		} else if (c == '\\') {
+			if (pos + 1 == end)
+				break;
+			++pos;
+		} else if (c == '(') {
+			++out->depth;
+		} else if (c == ')' && --out->depth == 0) {
+			token_append_run(out, begin, pos - begin);
+			out->type = TOKEN_TYPE_SUBST;
 			return pos + 1 - begin;
 		}
-		++pos;
 	}
-	char quote = 0;
+	/* A backslash at the end is taken with the char after it. */
+	token_append_run(out, begin, pos - begin);
+	return pos - begin;
+}
+
+/**
+ * Parse the next token, or go on with the one cut by the end of the data
+ * before. Returns the number of bytes taken. The token's type is NONE if
+ * the data ended before the token did. Chars which need the next one to be
+ * understood, like '\' and '>', are left for the next call then.
+ */
+static uint32_t
+parse_token(const char *pos, const char *end, struct token *out)
+{
+	const char *begin = pos;
+	if (out->depth > 0)
+		return parse_subst(pos, end, out);
+	char quote = out->quote;
+	if (quote == '#')
+		goto comment;
+	if (quote == 0 && out->size == 0) {
+		while (pos < end) {
+			if (!isspace(*pos))
+				break;
+			if (*pos == '\n') {
+				out->type = TOKEN_TYPE_NEW_LINE;
+				return pos + 1 - begin;
+			}
+			++pos;
+		}
+	}
 	while (pos < end) {
 		char c = *pos;
 		switch(c) {
@@ -158,8 +712,6 @@ parse_token(const char *pos, const char *end, struct token *out)
 			if (quote == 0) {
 				quote = c;
 				++pos;
-				if (pos == end)
-					return 0;
 				continue;
 			}
 			if (quote != c)
@@ -169,10 +721,10 @@ parse_token(const char *pos, const char *end, struct token *out)
 		case '\\':
 			if (quote == '\'')
 				goto append_and_next;
+			if (pos + 1 == end)
+				goto cut;
 			if (quote == '"') {
 				++pos;
-				if (pos == end)
-					return 0;
 				c = *pos;
 				switch (c)
 				{
@@ -191,8 +743,6 @@ parse_token(const char *pos, const char *end, struct token *out)
 			}
 			assert(quote == 0);
 			++pos;
-			if (pos == end)
-				return 0;
 			c = *pos;
 			if (c == '\n') {
 				++pos;
@@ -208,9 +758,9 @@ parse_token(const char *pos, const char *end, struct token *out)
 				out->type = TOKEN_TYPE_STR;
 				return pos - begin;
 			}
+			if (pos + 1 == end)
+				goto cut;
 			++pos;
-			if (pos == end)
-				return 0;
 			if (*pos == c) {
 				switch(c) {
 				case '&':
@@ -258,6 +808,25 @@ parse_token(const char *pos, const char *end, struct token *out)
 			assert(out->size > 0);
 			out->type = TOKEN_TYPE_STR;
 			return pos - begin;
+		case '<':
+			if (quote != 0)
+				goto append_and_next;
+			if (pos + 1 == end)
+				goto cut;
+			/* Other '<' are plain chars. */
+			if (pos[1] != '<' && pos[1] != '(')
+				goto append_and_next;
+			if (out->size > 0) {
+				out->type = TOKEN_TYPE_STR;
+				return pos - begin;
+			}
+			if (pos[1] == '<') {
+				out->type = TOKEN_TYPE_HEREDOC;
+				return pos + 2 - begin;
+			}
+			out->depth = 1;
+			pos += 2;
+			return pos - begin + parse_subst(pos, end, out);
 		case '#':
 			if (quote != 0)
 				goto append_and_next;
@@ -265,178 +834,417 @@ parse_token(const char *pos, const char *end, struct token *out)
 				out->type = TOKEN_TYPE_STR;
 				return pos - begin;
 			}
+			quote = '#';
 			++pos;
-			while (pos < end) {
-				if (*pos == '\n') {
-					out->type = TOKEN_TYPE_NEW_LINE;
-					return pos + 1 - begin;
-				}
-				++pos;
-			}
-			return 0;
+			goto comment;
 		default:
-			goto append_and_next;
+			break;
 		}
+		/* Plain chars are copied by whole runs, only stops are parsed. */
+		const char *run_end;
+		if (quote == 0)
+			run_end = scan_run(pos + 1, end, &word_stops);
+		else if (quote == '"')
+			run_end = scan_run(pos + 1, end, &double_quote_stops);
+		else
+			run_end = scan_run(pos + 1, end, &single_quote_stops);
+		token_append_run(out, pos, run_end - pos);
+		pos = run_end;
+		continue;
 	append_and_next:
 		token_append(out, c);
 		++pos;
 	}
-	return 0;
+cut:
+	out->quote = quote;
+	return pos - begin;
+
+comment:
+	pos = memchr(pos, '\n', end - pos);
+	if (pos == NULL) {
+		out->quote = '#';
+		return end - begin;
+	}
+	out->type = TOKEN_TYPE_NEW_LINE;
+	return pos + 1 - begin;
 }
 
-enum parser_error
-parser_pop_next(struct parser *p, struct command_line **out)
+static uint32_t
+plan_hash(const char *data, uint32_t size)
 {
-	struct command_line *line = calloc(1, sizeof(*line));
-	char *pos = p->buffer;
-	const char *begin = pos;
-	char *end = pos + p->size;
-	struct token token = {0};
-	enum parser_error res = PARSER_ERR_NONE;
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ size;
+	for (; size >= 8; data += 8, size -= 8) {
+		uint64_t v;
+		memcpy(&v, data, sizeof(v));
+		h = (h ^ v) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	for (; size > 0; ++data, --size)
+		h = (h ^ (unsigned char)*data) * 0x100000001b3ULL;
+	return (uint32_t)(h ^ (h >> 29));
+}
 
-	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-		struct expr *e;
-		switch(token.type) {
-		case TOKEN_TYPE_STR:
-			if (line->tail != NULL && line->tail->type == EXPR_TYPE_COMMAND) {
-				command_append_arg(&line->tail->cmd, token_strdup(&token));
-				continue;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_COMMAND;
-			e->cmd.exe = token_strdup(&token);
-			command_line_append(line, e);
-			continue;
-		case TOKEN_TYPE_NEW_LINE:
-			/* Skip new lines. */
-			if (line->tail == NULL)
-				continue;
-			goto close_and_return;
-		case TOKEN_TYPE_PIPE:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_PIPE_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_PIPE;
-			command_line_append(line, e);
-			continue;
-		case TOKEN_TYPE_AND:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_AND_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_AND;
-			command_line_append(line, e);
-			continue;
-		case TOKEN_TYPE_OR:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_OR_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_OR;
-			command_line_append(line, e);
-			continue;
-		case TOKEN_TYPE_OUT_NEW:
-		case TOKEN_TYPE_OUT_APPEND:
-		case TOKEN_TYPE_BACKGROUND:
-			goto close_and_return;
-		default:
-			assert(false);
+/**
+ * Look up the line starting at the parser's position in the plan cache.
+ * The key is the text up to the first new line. Only the bytes fed since
+ * the last call are searched for it, and the text is compared with the
+ * plan once, so a line fed by small parts is not scanned again and again.
+ */
+static struct plan *
+parser_find_plan(struct parser *p)
+{
+	struct line_state *s = &p->current;
+	const char *begin = p->buffer + p->pos;
+	uint32_t avail = p->size - p->pos;
+	if (s->key_size == 0) {
+		uint32_t limit = avail < PLAN_TEXT_MAX ? avail : PLAN_TEXT_MAX;
+		if (s->key_scanned >= limit)
+			return NULL;
+		const char *nl = memchr(begin + s->key_scanned, '\n',
+					limit - s->key_scanned);
+		if (nl == NULL) {
+			s->key_scanned = limit;
+			return NULL;
 		}
+		s->key_size = nl - begin + 1;
+		s->hash = plan_hash(begin, s->key_size);
+	}
+	if (s->is_plan_checked)
+		return NULL;
+	struct plan *plan = p->plans[s->hash & (PLAN_CACHE_SIZE - 1)];
+	if (plan == NULL || plan->hash != s->hash ||
+	    plan->key_size != s->key_size) {
+		s->is_plan_checked = true;
+		return NULL;
+	}
+	if (plan->text_size > avail)
+		return NULL;
+	s->is_plan_checked = true;
+	if (memcmp(plan->text, begin, plan->text_size) != 0)
+		return NULL;
+	return plan;
+}
+
+/**
+ * Cache the just parsed line if its text was seen before. Takes the line's
+ * arena on success.
+ */
+static void
+parser_add_plan(struct parser *p, struct command_line *line, uint32_t hash,
+		uint32_t key_size, const char *text, uint32_t text_size)
+{
+	uint32_t slot = hash & (PLAN_CACHE_SIZE - 1);
+	if (p->seen_hashes[slot] != hash) {
+		p->seen_hashes[slot] = hash;
+		return;
 	}
-	goto return_no_line;
+	struct plan *old = p->plans[slot];
+	if (text_size > PLAN_TEXT_MAX || (old != NULL && old->refs > 0))
+		return;
+	if (old != NULL)
+		plan_delete(old);
+	struct plan *plan = malloc(sizeof(*plan) + text_size);
+	plan->hash = hash;
+	plan->key_size = key_size;
+	plan->text_size = text_size;
+	plan->refs = 1;
+	plan->line = line;
+	memcpy(plan->text, text, text_size);
+	line->arena->plan = plan;
+	p->plans[slot] = plan;
+}
 
-close_and_return:
-	if (token.type == TOKEN_TYPE_OUT_NEW || token.type == TOKEN_TYPE_OUT_APPEND)
-	{
-		if (token.type == TOKEN_TYPE_OUT_NEW)
-			line->out_type = OUTPUT_TYPE_FILE_NEW;
+static void
+parser_start_line(struct parser *p)
+{
+	struct line_state *s = &p->current;
+	struct line_arena *arena = parser_take_arena(p);
+	struct command_line *line = arena_alloc(arena, sizeof(*line));
+	memset(line, 0, sizeof(*line));
+	line->arena = arena;
+	s->line = line;
+	s->token.arena = arena;
+	s->token_begin = 0;
+	token_reset(&s->token);
+}
+
+/**
+ * Forget the line state, the text was consumed. The other fields are set
+ * when the next line gets to them.
+ */
+static void
+parser_end_line(struct parser *p)
+{
+	struct line_state *s = &p->current;
+	s->line = NULL;
+	s->stage = LINE_STAGE_WORDS;
+	s->scanned = 0;
+	s->heredocs = NULL;
+	s->key_size = 0;
+	s->key_scanned = 0;
+	s->is_plan_checked = false;
+}
+
+/** Consume the line's text and drop the line. */
+static void
+parser_skip_line(struct parser *p, uint32_t size)
+{
+	struct command_line *line = p->current.line;
+	parser_consume(p, size);
+	parser_end_line(p);
+	if (line != NULL)
+		command_line_delete(line);
+}
+
+/**
+ * The source of a word if it has chars which can make it expand, copied to
+ * the arena. NULL if it has none, like most words.
+ */
+static const char *
+word_expansion_source(struct line_arena *a, const char *begin,
+		      const char *end)
+{
+	if (scan_run(begin, end, &expansion_stops) == end)
+		return NULL;
+	while (isspace(*begin))
+		++begin;
+	uint32_t size = end - begin;
+	char *source = arena_alloc(a, size + 1);
+	memcpy(source, begin, size);
+	source[size] = 0;
+	return source;
+}
+
+/**
+ * Add a token to the line. Returns an error if the token can't be there.
+ * The stage is changed when the next tokens are not just more words. The
+ * source is the text the token was parsed from.
+ */
+static enum parser_error
+line_add_token(struct line_state *s, struct token *token, const char *source,
+	       const char *source_end)
+{
+	struct command_line *line = s->line;
+	struct line_arena *arena = line->arena;
+	struct expr *e;
+	switch (s->stage) {
+	case LINE_STAGE_WORDS:
+		break;
+	case LINE_STAGE_HEREDOC_DELIMITER: {
+		if (token->type != TOKEN_TYPE_STR)
+			return PARSER_ERR_HEREDOC_BAD_ARG;
+		/* Commit first, the token is at the arena's end. */
+		const char *delimiter = token_commit(token);
+		struct pending_heredoc *h = arena_alloc(arena, sizeof(*h));
+		h->cmd = &line->tail->cmd;
+		h->delimiter = delimiter;
+		h->next = NULL;
+		if (s->heredocs == NULL)
+			s->heredocs = h;
 		else
-			line->out_type = OUTPUT_TYPE_FILE_APPEND;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-		if (token.type != TOKEN_TYPE_STR) {
-			res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
-			goto return_error;
-		}
-		line->out_file = token_strdup(&token);
-		used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
+			s->last_heredoc->next = h;
+		s->last_heredoc = h;
+		s->stage = LINE_STAGE_WORDS;
+		return PARSER_ERR_NONE;
 	}
-	if (token.type == TOKEN_TYPE_BACKGROUND) {
-		line->is_background = true;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
+	case LINE_STAGE_OUT_FILE:
+		if (token->type != TOKEN_TYPE_STR)
+			return PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
+		line->out_file = token_commit(token);
+		line->out_file_source = word_expansion_source(arena, source,
+							      source_end);
+		s->stage = LINE_STAGE_AFTER_OUT;
+		return PARSER_ERR_NONE;
+	case LINE_STAGE_AFTER_OUT:
+		if (token->type == TOKEN_TYPE_BACKGROUND) {
+			line->is_background = true;
+			s->stage = LINE_STAGE_AFTER_BACKGROUND;
+			return PARSER_ERR_NONE;
+		}
+		/* Fallthrough. */
+	case LINE_STAGE_AFTER_BACKGROUND:
+		if (token->type != TOKEN_TYPE_NEW_LINE)
+			return PARSER_ERR_TOO_LATE_ARGUMENTS;
+		s->stage = LINE_STAGE_HEREDOC_BODIES;
+		return PARSER_ERR_NONE;
+	default:
+		assert(false);
+		return PARSER_ERR_NONE;
 	}
-	if (token.type == TOKEN_TYPE_NEW_LINE) {
-		assert(line->tail != NULL);
-		parser_consume(p, pos - begin);
-		if (line->tail->type != EXPR_TYPE_COMMAND) {
-			res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
-			goto return_no_line;
+	switch(token->type) {
+	case TOKEN_TYPE_STR: {
+		char *word = token_commit(token);
+		const char *expansion = word_expansion_source(arena, source,
+							      source_end);
+		if (line->tail != NULL && line->tail->type == EXPR_TYPE_COMMAND) {
+			command_append_arg(arena, &line->tail->cmd, word);
+		} else {
+			e = expr_new_command(arena, word);
+			command_line_append(line, e);
 		}
-		res = PARSER_ERR_NONE;
-		*out = line;
-		goto return_final;
+		if (expansion != NULL) {
+			command_append_expansion(arena, &line->tail->cmd,
+						 line->tail->cmd.arg_count,
+						 expansion);
+		}
+		return PARSER_ERR_NONE;
 	}
-	res = PARSER_ERR_TOO_LATE_ARGUMENTS;
-	goto return_error;
-
-return_error:
-	/*
-	 * Try to skip the whole current line. It can't be executed but can't
-	 * just crash here because of that.
-	 */
-	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			break;
-		pos += used;
-		if (token.type == TOKEN_TYPE_NEW_LINE) {
-			parser_consume(p, pos - begin);
-			goto return_no_line;
+	case TOKEN_TYPE_SUBST:
+		if (line->tail == NULL ||
+		    line->tail->type != EXPR_TYPE_COMMAND) {
+			e = expr_new_command(arena, token_commit(token));
+			command_line_append(line, e);
+		} else {
+			command_append_arg(arena, &line->tail->cmd,
+					   token_commit(token));
 		}
+		command_append_subst(arena, &line->tail->cmd,
+				     line->tail->cmd.arg_count);
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_HEREDOC:
+		if (line->tail == NULL ||
+		    line->tail->type != EXPR_TYPE_COMMAND)
+			return PARSER_ERR_HEREDOC_WITH_NO_COMMAND;
+		s->stage = LINE_STAGE_HEREDOC_DELIMITER;
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_NEW_LINE:
+		/* Skip new lines. */
+		if (line->tail != NULL)
+			s->stage = LINE_STAGE_HEREDOC_BODIES;
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_PIPE:
+		if (line->tail == NULL)
+			return PARSER_ERR_PIPE_WITH_NO_LEFT_ARG;
+		if (line->tail->type != EXPR_TYPE_COMMAND)
+			return PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
+		command_line_append(line, expr_new(arena, EXPR_TYPE_PIPE));
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_AND:
+		if (line->tail == NULL)
+			return PARSER_ERR_AND_WITH_NO_LEFT_ARG;
+		if (line->tail->type != EXPR_TYPE_COMMAND)
+			return PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
+		command_line_append(line, expr_new(arena, EXPR_TYPE_AND));
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_OR:
+		if (line->tail == NULL)
+			return PARSER_ERR_OR_WITH_NO_LEFT_ARG;
+		if (line->tail->type != EXPR_TYPE_COMMAND)
+			return PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
+		command_line_append(line, expr_new(arena, EXPR_TYPE_OR));
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_OUT_NEW:
+		line->out_type = OUTPUT_TYPE_FILE_NEW;
+		s->stage = LINE_STAGE_OUT_FILE;
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_OUT_APPEND:
+		line->out_type = OUTPUT_TYPE_FILE_APPEND;
+		s->stage = LINE_STAGE_OUT_FILE;
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_BACKGROUND:
+		line->is_background = true;
+		s->stage = LINE_STAGE_AFTER_BACKGROUND;
+		return PARSER_ERR_NONE;
+	default:
+		assert(false);
+		return PARSER_ERR_NONE;
 	}
-	res = PARSER_ERR_NONE;
-	goto return_no_line;
+}
 
-return_no_line:
-	command_line_delete(line);
+enum parser_error
+parser_pop_next(struct parser *p, struct command_line **out)
+{
+	struct line_state *s = &p->current;
 	*out = NULL;
+	/* Nothing new since the last call, nothing can change. */
+	if (p->pos + s->scanned == p->size)
+		return PARSER_ERR_NONE;
+	struct plan *plan = parser_find_plan(p);
+	if (plan != NULL) {
+		/* The line started by the last calls is not needed. */
+		parser_skip_line(p, plan->text_size);
+		++plan->refs;
+		++p->arenas_in_use;
+		++p->stats.plan_hits;
+		*out = plan->line;
+		return PARSER_ERR_NONE;
+	}
+	if (s->line == NULL)
+		parser_start_line(p);
+	struct command_line *line = s->line;
+	struct token *token = &s->token;
+	const char *begin = p->buffer + p->pos;
+	const char *pos = begin + s->scanned;
+	const char *end = p->buffer + p->size;
 
-return_final:
-	free(token.data);
-	return res;
+	while (s->stage != LINE_STAGE_HEREDOC_BODIES) {
+		if (token->type != TOKEN_TYPE_NONE) {
+			token_reset(token);
+			s->token_begin = pos - begin;
+		}
+		pos += parse_token(pos, end, token);
+		if (token->type == TOKEN_TYPE_NONE) {
+			s->scanned = pos - begin;
+			return PARSER_ERR_NONE;
+		}
+		if (s->stage == LINE_STAGE_SKIP) {
+			/*
+			 * The line can't be executed, but can't just crash
+			 * here because of that. Skip it up to its end.
+			 */
+			if (token->type == TOKEN_TYPE_NEW_LINE) {
+				enum parser_error err = s->error;
+				parser_skip_line(p, pos - begin);
+				return err;
+			}
+			continue;
+		}
+		enum parser_error err = line_add_token(s, token,
+						       begin + s->token_begin,
+						       pos);
+		if (err != PARSER_ERR_NONE) {
+			s->stage = LINE_STAGE_SKIP;
+			s->error = err;
+		} else if (s->stage == LINE_STAGE_HEREDOC_BODIES) {
+			s->heredoc = s->heredocs;
+			s->body = s->body_line = pos - begin;
+		}
+	}
+	pos = parse_heredocs(s, begin, pos, end);
+	if (s->heredoc != NULL) {
+		s->scanned = pos - begin;
+		return PARSER_ERR_NONE;
+	}
+	uint32_t size = pos - begin;
+	if (line->tail == NULL || line->tail->type != EXPR_TYPE_COMMAND) {
+		parser_skip_line(p, size);
+		return PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
+	}
+	line_strip_time(line);
+	++p->stats.plan_misses;
+	/* The key is found if the line is not too long to be cached. */
+	if (s->key_size != 0)
+		parser_add_plan(p, line, s->hash, s->key_size, begin, size);
+	parser_consume(p, size);
+	parser_end_line(p);
+	*out = line;
+	return PARSER_ERR_NONE;
+}
+
+void
+parser_get_stats(const struct parser *p, struct parser_stats *stats)
+{
+	*stats = p->stats;
 }
 
 void
 parser_delete(struct parser *p)
 {
-	free(p->buffer);
-	free(p);
+	/* A not complete line is dropped with its text. */
+	if (p->current.line != NULL)
+		parser_skip_line(p, 0);
+	if (p->arenas_in_use > 0)
+		p->is_deleted = true;
+	else
+		parser_free(p);
 }
\ No newline at end of file
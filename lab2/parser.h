@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 struct parser;
+struct line_arena;
 
 enum parser_error {
 	PARSER_ERR_NONE,
@@ -16,13 +17,41 @@ enum parser_error {
 	PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG,
 	PARSER_ERR_TOO_LATE_ARGUMENTS,
 	PARSER_ERR_ENDS_NOT_WITH_A_COMMAND,
+	PARSER_ERR_HEREDOC_WITH_NO_COMMAND,
+	PARSER_ERR_HEREDOC_BAD_ARG,
+};
+
+/**
+ * A word with '$' or glob chars, which can expand to other words when the
+ * command is run. Whether the chars are quoted is seen from the source.
+ */
+struct word_expansion {
+	/** Index in argv. The arg there is the word with quotes removed. */
+	uint32_t index;
+	/** The word as written in the line, with quotes and backslashes. */
+	const char *source;
 };
 
 struct command {
 	char *exe;
+	/** Arguments after the exe. Points into argv. */
 	char** args;
 	uint32_t arg_count;
 	uint32_t arg_capacity;
+	/** Exe, then args, then NULL. Can be passed to exec as is. */
+	char **argv;
+	/** Here-document given with '<<', it is the stdin. NULL if none. */
+	char *heredoc;
+	uint32_t heredoc_size;
+	/**
+	 * Indexes in argv of the process substitutions, '<(cmd)'. The arg is
+	 * the command text, it is replaced with a path to the command output.
+	 */
+	uint32_t *substs;
+	uint32_t subst_count;
+	/** Words to expand, by increasing index. */
+	struct word_expansion *expansions;
+	uint32_t expansion_count;
 };
 
 enum expr_type {
@@ -51,9 +80,22 @@ struct command_line {
 	enum output_type out_type;
 	/** Valid if the out type is FILE. */
 	char *out_file;
+	/**
+	 * The out file as written, if it has chars which can make it expand.
+	 * NULL if not.
+	 */
+	const char *out_file_source;
 	bool is_background;
+	/** The line is prefixed with 'time'. */
+	bool is_timed;
+	/** Memory of the line, all the fields above are allocated in it. */
+	struct line_arena *arena;
 };
 
+/**
+ * Lines can be shared with the parser's cache of parsed lines, so they must
+ * not be changed.
+ */
 void
 command_line_delete(struct command_line *line);
 
@@ -66,5 +108,15 @@ parser_feed(struct parser *p, const char *str, uint32_t len);
 enum parser_error
 parser_pop_next(struct parser *p, struct command_line **out);
 
+struct parser_stats {
+	/** Lines taken from the cache of parsed lines. */
+	uint64_t plan_hits;
+	/** Lines which were parsed. */
+	uint64_t plan_misses;
+};
+
+void
+parser_get_stats(const struct parser *p, struct parser_stats *stats);
+
 void
 parser_delete(struct parser *p);
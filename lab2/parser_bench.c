@@ -0,0 +1,164 @@
+#include "parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Parser micro-benchmark. Inputs made of the lines from parser_test.c, of
+ * lines which never repeat, and of long words and quoted strings, are parsed
+ * line by line and the speed is reported in MB/s, with the share of lines
+ * taken from the cache of parsed lines. Lines with huge quoted arguments are
+ * also fed by single bytes and small parts, like a slow pipe gives them.
+ *
+ * Usage: ./parser_bench [input size in MB]
+ */
+
+static const char *test_lines[] = {
+	"ls\n",
+	"   pwd \n",
+	"mkdir ../testdir   \t\r  \n",
+	"touch \"my file with whitespaces in name.txt\"\n",
+	"echo '123 456 \\\" str \\\"'\n",
+	"echo \"test 'test'' \\\\\"\n",
+	"echo '123 456 \\\" str \\\"' > \"my file with whitespaces in name.txt\"\n",
+	"echo \"test\" >> \"my file with whitespaces in name.txt\"\n",
+	"echo \"4\">file\n",
+	"cat my\\ file\\ with\\ whitespaces\\ in\\ name.txt\n",
+	"echo 123\\\n456\\\n| grep 2\n",
+	"echo 100|grep 100\n",
+	"echo 'source string' | sed 's/source/destination/g' | "
+		"sed 's/string/value/g'\n",
+	"yes bigdata | head -n 100000 | wc -l | tr -d [:blank:]\n",
+	"echo 100 # comment ' ' \\ \\\n",
+	"grep 300 400 # comm\n",
+	"echo \"123\n456\n7\n\" | grep 4\n",
+	"true || false || true && echo 123\n",
+	"echo 100 | grep 1 && echo 200 | grep 2\n",
+	"sleep 0.5 && echo 'back sleep is done' > test.txt &\n",
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *
+make_input(const char **lines, int line_count, size_t size, size_t *out_size)
+{
+	char *buf = malloc(size + 4096);
+	size_t pos = 0;
+	for (int i = 0; pos < size; i = (i + 1) % line_count) {
+		size_t len = strlen(lines[i]);
+		memcpy(buf + pos, lines[i], len);
+		pos += len;
+	}
+	*out_size = pos;
+	return buf;
+}
+
+static void
+bench(const char *name, const char *input, size_t size, uint32_t feed_size)
+{
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+	size_t line_count = 0;
+	double start = now();
+	for (size_t pos = 0; pos < size; pos += feed_size) {
+		uint32_t len = feed_size;
+		if (size - pos < len)
+			len = size - pos;
+		parser_feed(p, input + pos, len);
+		while (true) {
+			enum parser_error err = parser_pop_next(p, &line);
+			if (err == PARSER_ERR_NONE && line == NULL)
+				break;
+			if (err != PARSER_ERR_NONE)
+				continue;
+			++line_count;
+			command_line_delete(line);
+		}
+	}
+	double seconds = now() - start;
+	struct parser_stats stats;
+	parser_get_stats(p, &stats);
+	parser_delete(p);
+	uint64_t lookups = stats.plan_hits + stats.plan_misses;
+	printf("%-12s feed %8u: %8.2f MB/s %12.0f lines/s %6.1f%% cached\n",
+	       name, feed_size, size / seconds / (1024 * 1024),
+	       line_count / seconds,
+	       lookups > 0 ? 100.0 * stats.plan_hits / lookups : 0.0);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t size = (argc > 1 ? atoi(argv[1]) : 32) * 1024 * 1024;
+	size_t real_size;
+
+	char *input = make_input(test_lines,
+				 sizeof(test_lines) / sizeof(test_lines[0]),
+				 size, &real_size);
+	bench("test lines", input, real_size, 1024);
+	bench("test lines", input, real_size, 1024 * 1024);
+	free(input);
+
+	/* Lines which never repeat, nothing can be taken from the cache. */
+	input = malloc(size + 4096);
+	real_size = 0;
+	for (int i = 0; real_size < size; ++i) {
+		real_size += sprintf(input + real_size,
+				     "echo %d | grep '%d' > \"out %d\"\n",
+				     i, i % 7, i);
+	}
+	bench("unique lines", input, real_size, 1024 * 1024);
+	free(input);
+
+	/* Long plain words, like paths and big arguments. */
+	char *word_line = malloc(4096 + 16);
+	strcpy(word_line, "echo ");
+	for (int i = 0; i < 4096; ++i)
+		word_line[5 + i] = i % 64 == 63 ? ' ' : 'a' + i % 26;
+	strcpy(word_line + 5 + 4096, "\n");
+	const char *word_lines[] = {word_line};
+	input = make_input(word_lines, 1, size, &real_size);
+	bench("long words", input, real_size, 1024 * 1024);
+	free(input);
+
+	/* Long quoted strings. */
+	char *quoted_line = malloc(4096 + 16);
+	strcpy(quoted_line, "echo \"");
+	for (int i = 0; i < 4096; ++i)
+		quoted_line[6 + i] = i % 16 == 15 ? ' ' : 'a' + i % 26;
+	strcpy(quoted_line + 6 + 4096, "\"\n");
+	const char *quoted_lines[] = {quoted_line};
+	input = make_input(quoted_lines, 1, size, &real_size);
+	bench("quoted", input, real_size, 1024 * 1024);
+	free(input);
+
+	/*
+	 * Huge quoted arguments fed by parts. Each part must only go on with
+	 * the cut token, not parse the line from its start again.
+	 */
+	enum { HUGE_ARG_SIZE = 64 * 1024 };
+	char *huge_line = malloc(HUGE_ARG_SIZE + 16);
+	strcpy(huge_line, "echo '");
+	for (int i = 0; i < HUGE_ARG_SIZE; ++i)
+		huge_line[6 + i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+	strcpy(huge_line + 6 + HUGE_ARG_SIZE, "'\n");
+	const char *huge_lines[] = {huge_line};
+	size_t huge_size = size < 4 * 1024 * 1024 ? size : 4 * 1024 * 1024;
+	input = make_input(huge_lines, 1, huge_size, &real_size);
+	bench("huge quoted", input, real_size, 1);
+	bench("huge quoted", input, real_size, 1024);
+	free(input);
+
+	free(word_line);
+	free(quoted_line);
+	free(huge_line);
+	return 0;
+}
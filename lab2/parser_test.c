@@ -819,6 +819,349 @@ test_errors(void)
 	unit_test_finish();
 }
 
+static void
+test_argv(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	const char *str = "echo 1 2 3 4 5 6 7 8 9 10 | grep 1 > out\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	struct expr *e = line->head;
+	unit_check(e->cmd.argv[0] == e->cmd.exe, "argv[0] is exe");
+	unit_check(e->cmd.args == e->cmd.argv + 1, "args follow exe");
+	unit_check(e->cmd.arg_count == 10, "arg count");
+	unit_check(strcmp(e->cmd.argv[10], "10") == 0, "last arg");
+	unit_check(e->cmd.argv[11] == NULL, "argv ends with NULL");
+	e = e->next->next;
+	unit_check(strcmp(e->cmd.argv[0], "grep") == 0 &&
+		   strcmp(e->cmd.argv[1], "1") == 0 && e->cmd.argv[2] == NULL,
+		   "second command argv");
+	unit_check(strcmp(line->out_file, "out") == 0, "out file");
+	command_line_delete(line);
+
+	unit_msg("Lines can outlive the parser");
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	parser_delete(p);
+	unit_check(strcmp(line->head->cmd.argv[5], "5") == 0, "line is valid");
+	command_line_delete(line);
+
+	unit_test_finish();
+}
+
+static void
+test_plan_cache(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+	struct command_line *lines[3];
+	struct parser_stats stats;
+
+	const char *str = "time echo 1 | grep 1 >> out &\n";
+	for (int i = 0; i < 3; ++i) {
+		parser_feed(p, str, strlen(str));
+		unit_check(parser_pop_next(p, &lines[i]) == PARSER_ERR_NONE,
+			   "parse");
+	}
+	parser_get_stats(p, &stats);
+	unit_check(stats.plan_misses == 2 && stats.plan_hits == 1,
+		   "the line is cached when seen the second time");
+	unit_check(lines[2] == lines[1], "cached line is shared");
+	line = lines[2];
+	unit_check(line->is_timed && line->is_background, "flags");
+	unit_check(strcmp(line->head->cmd.exe, "echo") == 0 &&
+		   line->head->cmd.argv[0] == line->head->cmd.exe &&
+		   line->head->cmd.arg_count == 1, "time is not a command");
+	unit_check(line->out_type == OUTPUT_TYPE_FILE_APPEND &&
+		   strcmp(line->out_file, "out") == 0, "out file");
+	for (int i = 0; i < 3; ++i)
+		command_line_delete(lines[i]);
+
+	unit_msg("Same first line, different text");
+	str = "echo \"1\n2\"\n";
+	for (int i = 0; i < 2; ++i) {
+		parser_feed(p, str, strlen(str));
+		unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE,
+			   "parse");
+		command_line_delete(line);
+	}
+	str = "echo \"1\n3\"\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line->head->cmd.args[0], "1\n3") == 0,
+		   "the whole text is compared");
+	command_line_delete(line);
+
+	unit_msg("Incomplete cached text");
+	parser_feed(p, "echo \"1\n", 8);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE &&
+		   line == NULL, "no line yet");
+	parser_feed(p, "3\"\n", 3);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line->head->cmd.args[0], "1\n3") == 0,
+		   "the last parsed text replaced the older one");
+	command_line_delete(line);
+	parser_get_stats(p, &stats);
+	unit_check(stats.plan_hits == 2, "hits");
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_heredoc(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	const char *str = "cat <<EOF | wc -l\nline 1\n  'line' \"2\"\nEOF\necho\n";
+	uint32_t len = strlen(str);
+	for (uint32_t i = 0; i < len - 6; ++i) {
+		parser_feed(p, &str[i], 1);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		unit_fail_if(line != NULL);
+	}
+	parser_feed(p, &str[len - 6], 6);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line != NULL, "the line is ready after the delimiter");
+	struct expr *e = line->head;
+	unit_check(strcmp(e->cmd.exe, "cat") == 0 && e->cmd.arg_count == 0,
+		   "the delimiter is not an argument");
+	unit_check(e->cmd.heredoc_size == 20 &&
+		   strcmp(e->cmd.heredoc, "line 1\n  'line' \"2\"\n") == 0,
+		   "the body is taken as is");
+	unit_check(e->next->next->cmd.heredoc == NULL, "no here-document");
+	command_line_delete(line);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line->head->cmd.exe, "echo") == 0,
+		   "the next line follows the delimiter");
+	command_line_delete(line);
+
+	unit_msg("Two here-documents");
+	str = "cat <<A && cat <<'B'\na\nA\nb\nB\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	e = line->head;
+	unit_check(strcmp(e->cmd.heredoc, "a\n") == 0 &&
+		   strcmp(e->next->next->cmd.heredoc, "b\n") == 0,
+		   "bodies go in order");
+	command_line_delete(line);
+
+	unit_msg("Empty body");
+	str = "cat <<EOF\nEOF\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line->head->cmd.heredoc_size == 0 &&
+		   line->head->cmd.heredoc[0] == 0, "empty body");
+	command_line_delete(line);
+
+	test_error_one(p, "<<EOF", PARSER_ERR_HEREDOC_WITH_NO_COMMAND);
+	test_error_one(p, "cat << &&", PARSER_ERR_HEREDOC_BAD_ARG);
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_process_substitution(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	const char *str = "diff <(sort a | uniq) -u <(echo ')' \"(\" (x))\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	struct command *cmd = &line->head->cmd;
+	unit_check(line->head->next == NULL, "the pipe is inside");
+	unit_check(cmd->arg_count == 3 && cmd->subst_count == 2,
+		   "argument count");
+	unit_check(cmd->substs[0] == 1 && cmd->substs[1] == 3,
+		   "argv indexes");
+	unit_check(strcmp(cmd->argv[1], "sort a | uniq") == 0, "text 1");
+	unit_check(strcmp(cmd->argv[3], "echo ')' \"(\" (x)") == 0,
+		   "quotes and nested parentheses");
+	command_line_delete(line);
+
+	unit_msg("Substitution with time and as a command");
+	str = "time cat <(ls)\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line->is_timed && line->head->cmd.substs[0] == 1,
+		   "the index is after time is removed");
+	command_line_delete(line);
+	str = "<(echo ls)\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line->head->cmd.substs[0] == 0, "the exe");
+	command_line_delete(line);
+
+	unit_msg("Plain '<'");
+	str = "echo a<b\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line->head->cmd.args[0], "a<b") == 0, "char");
+	command_line_delete(line);
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_expansion(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	const char *str = "echo a $HOME \"x $y\" '*' b*c\\? \\\nd > \"$OUT\"\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	struct command *cmd = &line->head->cmd;
+	unit_check(cmd->arg_count == 6 && cmd->expansion_count == 4,
+		   "expansion count");
+	unit_check(cmd->expansions[0].index == 2 &&
+		   strcmp(cmd->expansions[0].source, "$HOME ") == 0,
+		   "variable, with the space ending it");
+	unit_check(cmd->expansions[1].index == 3 &&
+		   strcmp(cmd->expansions[1].source, "\"x $y\"") == 0,
+		   "quotes are kept");
+	unit_check(cmd->expansions[2].index == 4 &&
+		   strcmp(cmd->expansions[2].source, "'*'") == 0,
+		   "quoted glob");
+	unit_check(cmd->expansions[3].index == 5 &&
+		   strcmp(cmd->expansions[3].source, "b*c\\? ") == 0,
+		   "glob with an escape");
+	unit_check(strcmp(line->out_file_source, "\"$OUT\"") == 0,
+		   "out file");
+	command_line_delete(line);
+
+	unit_msg("Plain words and time");
+	str = "time $X a > b\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	cmd = &line->head->cmd;
+	unit_check(cmd->expansion_count == 1 && cmd->expansions[0].index == 0,
+		   "the index is after time is removed");
+	unit_check(line->out_file_source == NULL, "plain out file");
+	command_line_delete(line);
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static bool
+str_equal(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+	return strcmp(a, b) == 0;
+}
+
+static bool
+line_equal(const struct command_line *a, const struct command_line *b)
+{
+	if (a->out_type != b->out_type || !str_equal(a->out_file, b->out_file) ||
+	    !str_equal(a->out_file_source, b->out_file_source) ||
+	    a->is_background != b->is_background || a->is_timed != b->is_timed)
+		return false;
+	const struct expr *ea = a->head;
+	const struct expr *eb = b->head;
+	for (; ea != NULL && eb != NULL; ea = ea->next, eb = eb->next) {
+		if (ea->type != eb->type)
+			return false;
+		if (ea->type != EXPR_TYPE_COMMAND)
+			continue;
+		const struct command *ca = &ea->cmd;
+		const struct command *cb = &eb->cmd;
+		if (ca->arg_count != cb->arg_count ||
+		    ca->subst_count != cb->subst_count ||
+		    ca->expansion_count != cb->expansion_count ||
+		    !str_equal(ca->heredoc, cb->heredoc))
+			return false;
+		for (uint32_t i = 0; i < ca->expansion_count; ++i) {
+			if (ca->expansions[i].index != cb->expansions[i].index ||
+			    !str_equal(ca->expansions[i].source,
+				       cb->expansions[i].source))
+				return false;
+		}
+		for (uint32_t i = 0; i <= ca->arg_count; ++i) {
+			if (!str_equal(ca->argv[i], cb->argv[i]))
+				return false;
+		}
+	}
+	return ea == eb;
+}
+
+static void
+test_resume(void)
+{
+	unit_test_start();
+	/*
+	 * Lines cut at any byte are parsed the same as whole ones, including
+	 * the cuts in quotes, comments, escapes, operators and '<(cmd)'.
+	 */
+	const char *lines[] = {
+		"echo \"a b\\\" c\" 'd \\ e' f\\ g \\\nh\n",
+		"  # comment ' \" \\\n  time ls -l>>out &\n",
+		"a||b&&c|d > \"out file\"\n",
+		"diff <(sort \"x)\" | uniq) <(echo ')' (y)) # c\n",
+		"cat <<EOF | grep 1\n1\n EOF\nEOF\n",
+		"echo 123\\\n456\\\n| grep 2\n",
+		"echo $A \"$B c\"*'$d' x\\*?|wc>$OUT\n",
+	};
+	struct parser *whole = parser_new();
+	struct parser *bytes = parser_new();
+	for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); ++i) {
+		struct command_line *expected = NULL;
+		struct command_line *line = NULL;
+		uint32_t len = strlen(lines[i]);
+		parser_feed(whole, lines[i], len);
+		unit_fail_if(parser_pop_next(whole, &expected) !=
+			     PARSER_ERR_NONE || expected == NULL);
+		for (uint32_t j = 0; j < len; ++j) {
+			unit_fail_if(line != NULL);
+			parser_feed(bytes, &lines[i][j], 1);
+			unit_fail_if(parser_pop_next(bytes, &line) !=
+				     PARSER_ERR_NONE);
+		}
+		unit_check(line != NULL && line_equal(line, expected),
+			   "same as parsed at once");
+		command_line_delete(expected);
+		command_line_delete(line);
+	}
+
+	unit_msg("Errors are found in parts too");
+	const char *str = "exe > && 'x\ny'\necho\n";
+	uint32_t len = strlen(str);
+	struct command_line *line = NULL;
+	for (uint32_t j = 0; j < len - 6; ++j) {
+		parser_feed(bytes, &str[j], 1);
+		unit_fail_if(parser_pop_next(bytes, &line) != PARSER_ERR_NONE);
+		unit_fail_if(line != NULL);
+	}
+	parser_feed(bytes, &str[len - 6], 6);
+	unit_check(parser_pop_next(bytes, &line) ==
+		   PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG && line == NULL,
+		   "the error is at the end of the line");
+	unit_check(parser_pop_next(bytes, &line) == PARSER_ERR_NONE &&
+		   strcmp(line->head->cmd.exe, "echo") == 0, "next line");
+	command_line_delete(line);
+
+	unit_msg("Not complete line is dropped with the parser");
+	parser_feed(bytes, "echo 'not complete", 18);
+	unit_check(parser_pop_next(bytes, &line) == PARSER_ERR_NONE &&
+		   line == NULL, "no line");
+	parser_delete(bytes);
+	parser_delete(whole);
+	unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -834,5 +1177,11 @@ main(void)
 	test_logical_operators();
 	test_background();
 	test_errors();
+	test_argv();
+	test_plan_cache();
+	test_heredoc();
+	test_process_substitution();
+	test_resume();
+	test_expansion();
 	return 0;
 }
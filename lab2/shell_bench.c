@@ -0,0 +1,237 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Throughput benchmark of the shell in script mode. A script of many lines
+ * is generated from commands like the ones in tests.txt and is fed to the
+ * shell binary, first as a script file argument (mapped by the shell), then
+ * through a pipe into stdin (read by blocks).
+ *
+ * Then a script of external commands is run with -j 1 and with a job per
+ * CPU, to see the speedup of the parallel script mode.
+ *
+ * Then a big file is pushed through 'cat big | ... > out' pipelines, with
+ * the builtin cat and with /bin/cat, and the speed is reported in MB/s.
+ *
+ * Usage: ./shell_bench [shell binary] [line count] [pipe data MB]
+ */
+
+// Lines are builtins with output to /dev/null, so the shell's own overhead is
+// measured, not the one of the started programs.
+static const char *script_lines[] = {
+	"true\n",
+	"cd .\n",
+	"echo 'source string' > /dev/null\n",
+	"echo \"test 'test'' \\\\\" >> /dev/null\n",
+	"# Comment\n",
+	"false || true\n",
+	"true && echo 123 > /dev/null\n",
+	"echo 123\\\n456 > /dev/null\n",
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t
+generate_script(const char *path, int line_count)
+{
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	size_t size = 0;
+	int n = sizeof(script_lines) / sizeof(script_lines[0]);
+	for (int i = 0; i < line_count; ++i)
+		size += fprintf(f, "%s", script_lines[i % n]);
+	fclose(f);
+	return size;
+}
+
+static void
+report(const char *name, double seconds, int line_count, size_t size)
+{
+	printf("%-14s %8.3f s %12.0f lines/s %8.2f MB/s\n", name, seconds,
+	       line_count / seconds, size / seconds / (1024 * 1024));
+}
+
+// Jobs is the -j value for the shell, or NULL.
+static double
+run_shell(const char *shell, const char *script, bool as_stdin,
+	  const char *jobs)
+{
+	fflush(stdout);
+	double start = now();
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (as_stdin) {
+			int fd[2];
+			if (pipe(fd) != 0)
+				exit(1);
+			if (fork() == 0) {
+				/* Feeder: the shell sees a pipe, not a file. */
+				close(fd[0]);
+				int in = open(script, O_RDONLY);
+				char buf[64 * 1024];
+				ssize_t rc;
+				while ((rc = read(in, buf, sizeof(buf))) > 0) {
+					if (write(fd[1], buf, rc) != rc)
+						break;
+				}
+				exit(0);
+			}
+			close(fd[1]);
+			dup2(fd[0], STDIN_FILENO);
+			close(fd[0]);
+			execl(shell, shell, (char *)NULL);
+		} else if (jobs != NULL) {
+			int out = open("/dev/null", O_WRONLY);
+			dup2(out, STDOUT_FILENO);
+			close(out);
+			execl(shell, shell, "-j", jobs, script, (char *)NULL);
+		} else {
+			execl(shell, shell, script, (char *)NULL);
+		}
+		fprintf(stderr, "%s: %s\n", shell, strerror(errno));
+		exit(1);
+	}
+	int status;
+	while (wait(&status) != -1)
+		;
+	return now() - start;
+}
+
+static void
+write_file(const char *path, const char *data)
+{
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	fputs(data, f);
+	fclose(f);
+}
+
+static void
+bench_pipeline(const char *shell, const char *name, const char *line,
+	       size_t size)
+{
+	/* Name NULL means a warm-up run, to get the files into memory. */
+	char script[] = "/tmp/shell_bench_pipe_XXXXXX";
+	int fd = mkstemp(script);
+	if (fd == -1)
+		return;
+	close(fd);
+	write_file(script, line);
+	double seconds = run_shell(shell, script, false, NULL);
+	if (name != NULL)
+		printf("%-30s %8.3f s %8.2f MB/s\n", name, seconds,
+		       size / seconds / (1024 * 1024));
+	unlink(script);
+}
+
+static void
+bench_parallel(const char *shell, int line_count)
+{
+	char script[] = "/tmp/shell_bench_parallel_XXXXXX";
+	int fd = mkstemp(script);
+	if (fd == -1)
+		return;
+	FILE *f = fdopen(fd, "w");
+	for (int i = 0; i < line_count; ++i)
+		fprintf(f, "expr %d + 1 | wc -c\n", i);
+	fclose(f);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	char jobs[24];
+	snprintf(jobs, sizeof(jobs), "%ld", cpus > 1 ? cpus : 2);
+	printf("%d external commands, -j 1 and -j %s\n", line_count, jobs);
+	double seconds = run_shell(shell, script, false, "1");
+	printf("%-14s %8.3f s %12.0f lines/s\n", "-j 1", seconds,
+	       line_count / seconds);
+	seconds = run_shell(shell, script, false, jobs);
+	printf("-j %-11s %8.3f s %12.0f lines/s\n", jobs, seconds,
+	       line_count / seconds);
+	unlink(script);
+}
+
+static void
+bench_pipelines(const char *shell, int mb)
+{
+	/* Files are kept in memory, if possible, to measure pipes, not disk. */
+	bool has_shm = access("/dev/shm", W_OK) == 0;
+	const char *big = has_shm ? "/dev/shm/shell_bench_big" :
+				    "/tmp/shell_bench_big";
+	const char *out = has_shm ? "/dev/shm/shell_bench_out" :
+				    "/tmp/shell_bench_out";
+	size_t size = (size_t)mb * 1024 * 1024;
+	FILE *f = fopen(big, "w");
+	if (f == NULL) {
+		fprintf(stderr, "%s: %s\n", big, strerror(errno));
+		exit(1);
+	}
+	char block[4096];
+	for (size_t i = 0; i < sizeof(block); ++i)
+		block[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+	for (size_t i = 0; i < size; i += sizeof(block))
+		fwrite(block, 1, sizeof(block), f);
+	fclose(f);
+	printf("%d MB through pipelines\n", mb);
+
+	char line[256];
+	snprintf(line, sizeof(line), "cat %s > %s\n", big, out);
+	bench_pipeline(shell, NULL, line, size);
+	bench_pipeline(shell, "cat big > out", line, size);
+	snprintf(line, sizeof(line), "/bin/cat %s > %s\n", big, out);
+	bench_pipeline(shell, "/bin/cat big > out", line, size);
+	snprintf(line, sizeof(line), "cat %s | cat | cat > %s\n", big, out);
+	bench_pipeline(shell, "cat big | cat | cat > out", line, size);
+	snprintf(line, sizeof(line),
+		 "/bin/cat %s | /bin/cat | /bin/cat > %s\n", big, out);
+	bench_pipeline(shell, "/bin/cat big | ... > out", line, size);
+	snprintf(line, sizeof(line), "cat %s | wc -l > %s\n", big, out);
+	bench_pipeline(shell, "cat big | wc -l > out", line, size);
+	unlink(big);
+	unlink(out);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *shell = argc > 1 ? argv[1] : "./a.out";
+	int line_count = argc > 2 ? atoi(argv[2]) : 100 * 1000;
+	char script[] = "/tmp/shell_bench_XXXXXX";
+	int fd = mkstemp(script);
+	if (fd == -1) {
+		fprintf(stderr, "mkstemp: %s\n", strerror(errno));
+		return 1;
+	}
+	close(fd);
+	size_t size = generate_script(script, line_count);
+	printf("%d lines, %zu bytes\n", line_count, size);
+
+	report("script file", run_shell(shell, script, false, NULL),
+	       line_count, size);
+	report("stdin pipe", run_shell(shell, script, true, NULL), line_count,
+	       size);
+	unlink(script);
+
+	bench_parallel(shell, line_count / 50);
+	bench_pipelines(shell, argc > 3 ? atoi(argv[3]) : 256);
+	return 0;
+}
@@ -0,0 +1,360 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Stress benchmark and latency harness of the shell. The shell is started
+ * once, with pipes as stdin and stdout, and gets its lines like from a user
+ * typing them. After the lines an 'echo' of a marker is sent, and the time
+ * until the marker comes back is the time of the lines.
+ *
+ * The workloads are thousands of short commands, pipelines of 1, 2 and
+ * many stages, a lot of data through a pipeline, and many background jobs.
+ * Commands/s, MB/s and percentiles of the pipeline latency are reported.
+ * After each workload the open fds of the shell and its zombie children are
+ * counted. They must not grow since the warm-up, or the exit code is 1.
+ *
+ * Usage: ./shell_stress [shell binary] [command count] [pipeline stages]
+ *                       [data MB]
+ */
+
+struct shell_proc {
+	pid_t pid;
+	/** The shell's stdin. */
+	int in_fd;
+	/** The shell's stdout. */
+	int out_fd;
+	/** Number of the last marker. */
+	unsigned marker;
+	/** The end of the output read so far, to find a marker cut in two. */
+	char tail[64];
+	size_t tail_size;
+};
+
+struct leak_stats {
+	int fds;
+	int children;
+	int zombies;
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+shell_start(struct shell_proc *sh, const char *path)
+{
+	int in[2], out[2];
+	if (pipe2(in, O_CLOEXEC) != 0 || pipe2(out, O_CLOEXEC) != 0) {
+		fprintf(stderr, "pipe: %s\n", strerror(errno));
+		exit(1);
+	}
+	sh->pid = fork();
+	if (sh->pid == 0) {
+		dup2(in[0], STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		execl(path, path, (char *)NULL);
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	close(in[0]);
+	close(out[1]);
+	sh->in_fd = in[1];
+	sh->out_fd = out[0];
+	sh->marker = 0;
+	sh->tail_size = 0;
+}
+
+/**
+ * Read what the shell printed, and look for the marker in it. Returns true
+ * if the marker is found.
+ */
+static bool
+shell_read(struct shell_proc *sh, const char *marker, size_t marker_size)
+{
+	char buf[sizeof(sh->tail) + 64 * 1024];
+	memcpy(buf, sh->tail, sh->tail_size);
+	ssize_t rc = read(sh->out_fd, buf + sh->tail_size,
+			  sizeof(buf) - sh->tail_size);
+	if (rc <= 0) {
+		fprintf(stderr, "the shell has exited\n");
+		exit(1);
+	}
+	size_t size = sh->tail_size + rc;
+	bool found = marker != NULL &&
+		     memmem(buf, size, marker, marker_size) != NULL;
+	sh->tail_size = size < sizeof(sh->tail) ? size : sizeof(sh->tail);
+	memcpy(sh->tail, buf + size - sh->tail_size, sh->tail_size);
+	if (found)
+		sh->tail_size = 0;
+	return found;
+}
+
+/**
+ * Send the lines to the shell, and then the marker, and wait until it is
+ * printed. The output is read while the lines are written, so the shell
+ * never blocks on a full stdout.
+ */
+static void
+shell_run(struct shell_proc *sh, const char *lines, size_t size)
+{
+	char marker[64];
+	int marker_size = snprintf(marker, sizeof(marker), "stress_marker_%u\n",
+				   ++sh->marker);
+	char echo[80];
+	int echo_size = snprintf(echo, sizeof(echo), "echo %s", marker);
+	const char *parts[] = {lines, echo};
+	size_t sizes[] = {size, echo_size};
+	int part = 0;
+	size_t pos = 0;
+	while (true) {
+		struct pollfd fds[2] = {
+			{.fd = sh->out_fd, .events = POLLIN},
+			{.fd = sh->in_fd, .events = POLLOUT},
+		};
+		int count = part < 2 ? 2 : 1;
+		if (poll(fds, count, -1) < 0 && errno != EINTR)
+			exit(1);
+		if (fds[0].revents != 0 && shell_read(sh, marker, marker_size))
+			return;
+		if (count == 2 && fds[1].revents != 0) {
+			ssize_t rc = write(sh->in_fd, parts[part] + pos,
+					   sizes[part] - pos);
+			if (rc < 0 && errno != EINTR && errno != EAGAIN)
+				exit(1);
+			if (rc > 0)
+				pos += rc;
+			if (pos == sizes[part]) {
+				++part;
+				pos = 0;
+			}
+		}
+	}
+}
+
+static int
+count_fds(pid_t pid)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/fd", (int)pid);
+	DIR *dir = opendir(path);
+	if (dir == NULL)
+		return -1;
+	int count = 0;
+	struct dirent *e;
+	while ((e = readdir(dir)) != NULL) {
+		if (e->d_name[0] != '.')
+			++count;
+	}
+	closedir(dir);
+	return count;
+}
+
+static void
+get_leak_stats(pid_t pid, struct leak_stats *stats)
+{
+	stats->fds = count_fds(pid);
+	stats->children = 0;
+	stats->zombies = 0;
+	DIR *dir = opendir("/proc");
+	if (dir == NULL)
+		return;
+	struct dirent *e;
+	while ((e = readdir(dir)) != NULL) {
+		if (e->d_name[0] < '0' || e->d_name[0] > '9')
+			continue;
+		char path[300], buf[512];
+		snprintf(path, sizeof(path), "/proc/%s/stat", e->d_name);
+		FILE *f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+		size_t size = fread(buf, 1, sizeof(buf) - 1, f);
+		fclose(f);
+		buf[size] = 0;
+		/* "pid (comm) state ppid ...", comm can have any chars. */
+		char *p = strrchr(buf, ')');
+		char state;
+		int ppid;
+		if (p == NULL || sscanf(p + 1, " %c %d", &state, &ppid) != 2 ||
+		    ppid != pid)
+			continue;
+		++stats->children;
+		if (state == 'Z')
+			++stats->zombies;
+	}
+	closedir(dir);
+}
+
+/** Print the leak counts. Returns true if they grew since the base. */
+static bool
+check_leaks(struct shell_proc *sh, const struct leak_stats *base)
+{
+	struct leak_stats stats;
+	get_leak_stats(sh->pid, &stats);
+	printf("%-16s fds %d (%+d), children %d, zombies %d\n", "", stats.fds,
+	       stats.fds - base->fds, stats.children, stats.zombies);
+	return stats.fds > base->fds || stats.zombies > base->zombies ||
+	       stats.children > base->children;
+}
+
+/** A buffer with the line repeated count times. */
+static char *
+repeat_line(const char *line, int count, size_t *size)
+{
+	size_t len = strlen(line);
+	char *buf = malloc(len * count);
+	for (int i = 0; i < count; ++i)
+		memcpy(buf + i * len, line, len);
+	*size = len * count;
+	return buf;
+}
+
+static void
+bench_commands(struct shell_proc *sh, const char *name, const char *line,
+	       int line_count, int commands_per_line)
+{
+	size_t size;
+	char *lines = repeat_line(line, line_count, &size);
+	double start = now();
+	shell_run(sh, lines, size);
+	double seconds = now() - start;
+	free(lines);
+	printf("%-16s %8.3f s %12.0f commands/s\n", name, seconds,
+	       line_count * commands_per_line / seconds);
+}
+
+static int
+compare_doubles(const void *a, const void *b)
+{
+	double da = *(const double *)a;
+	double db = *(const double *)b;
+	return da < db ? -1 : da > db;
+}
+
+static void
+bench_latency(struct shell_proc *sh, int stage_count, int sample_count)
+{
+	/* Data goes through all the stages, like in real pipelines. */
+	size_t size = 64 + stage_count * 12;
+	char *line = malloc(size);
+	int len = sprintf(line, "/bin/echo %d", stage_count);
+	for (int i = 1; i < stage_count; ++i)
+		len += sprintf(line + len, " | /bin/cat");
+	sprintf(line + len, " > /dev/null\n");
+
+	double *samples = malloc(sample_count * sizeof(*samples));
+	for (int i = 0; i < sample_count; ++i) {
+		double start = now();
+		shell_run(sh, line, strlen(line));
+		samples[i] = (now() - start) * 1000;
+	}
+	qsort(samples, sample_count, sizeof(*samples), compare_doubles);
+	char name[32];
+	snprintf(name, sizeof(name), "%d stage%s", stage_count,
+		 stage_count > 1 ? "s" : "");
+	printf("%-16s p50 %7.3f ms  p90 %7.3f ms  p99 %7.3f ms  max %7.3f ms\n",
+	       name, samples[sample_count / 2],
+	       samples[sample_count * 9 / 10],
+	       samples[sample_count * 99 / 100], samples[sample_count - 1]);
+	free(samples);
+	free(line);
+}
+
+static void
+bench_data(struct shell_proc *sh, int mb)
+{
+	char line[128];
+	int len = snprintf(line, sizeof(line),
+			   "head -c %dM /dev/zero | /bin/cat | /bin/cat | "
+			   "wc -c > /dev/null\n", mb);
+	double start = now();
+	shell_run(sh, line, len);
+	double seconds = now() - start;
+	printf("%-16s %8.3f s %12.2f MB/s\n", "data", seconds, mb / seconds);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *path = argc > 1 ? argv[1] : "./a.out";
+	int command_count = argc > 2 ? atoi(argv[2]) : 2000;
+	int stage_count = argc > 3 ? atoi(argv[3]) : 128;
+	int mb = argc > 4 ? atoi(argv[4]) : 256;
+	if (command_count < 1 || stage_count < 2 || mb < 1) {
+		fprintf(stderr, "Usage: %s [shell binary] [command count] "
+			"[pipeline stages] [data MB]\n", argv[0]);
+		return 2;
+	}
+	/* A dead shell must be an error message, not a signal. */
+	signal(SIGPIPE, SIG_IGN);
+	struct shell_proc sh;
+	shell_start(&sh, path);
+
+	/* Lazily created fds of the shell are made here, before the base. */
+	const char *warm_up = "true | true\n/bin/true &\nwait\n";
+	shell_run(&sh, warm_up, strlen(warm_up));
+	struct leak_stats base;
+	get_leak_stats(sh.pid, &base);
+	printf("shell %d: fds %d, children %d\n", (int)sh.pid, base.fds,
+	       base.children);
+	bool has_leaks = false;
+
+	bench_commands(&sh, "builtins", "true\n", command_count * 10, 1);
+	bench_commands(&sh, "commands", "/bin/true\n", command_count, 1);
+	bench_commands(&sh, "pipes", "/bin/true | /bin/true\n",
+		       command_count / 2, 2);
+	bench_commands(&sh, "and, or", "/bin/false || /bin/true && true\n",
+		       command_count / 2, 3);
+	has_leaks |= check_leaks(&sh, &base);
+
+	bench_latency(&sh, 1, 500);
+	bench_latency(&sh, 2, 500);
+	bench_latency(&sh, stage_count, 50);
+	has_leaks |= check_leaks(&sh, &base);
+
+	bench_data(&sh, mb);
+	has_leaks |= check_leaks(&sh, &base);
+
+	/* Jobs finish while more are started, and are reaped meanwhile. */
+	char *jobs = malloc(command_count * 16 + 16);
+	size_t size = 0;
+	for (int i = 0; i < command_count; ++i)
+		size += sprintf(jobs + size, "/bin/true &\n");
+	size += sprintf(jobs + size, "wait\n");
+	double start = now();
+	shell_run(&sh, jobs, size);
+	double seconds = now() - start;
+	free(jobs);
+	printf("%-16s %8.3f s %12.0f commands/s\n", "background", seconds,
+	       command_count / seconds);
+	has_leaks |= check_leaks(&sh, &base);
+
+	close(sh.in_fd);
+	int status;
+	waitpid(sh.pid, &status, 0);
+	close(sh.out_fd);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "the shell failed, status %d\n", status);
+		return 1;
+	}
+	if (has_leaks) {
+		fprintf(stderr, "fds or processes leaked\n");
+		return 1;
+	}
+	return 0;
+}
@@ -1,309 +1,2511 @@
+#define _GNU_SOURCE
+
 #include "parser.h"
 
 #include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fnmatch.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <stdlib.h>
 
 // constants used in code
 #define EXIT_CODE 	5
-#define CD_CODE 	6
+// Input is read by blocks of this size when it can't be mapped.
+#define SCRIPT_BLOCK_SIZE	(64 * 1024)
+// Mapped scripts are fed to the parser by windows of this size.
+#define SCRIPT_WINDOW_SIZE	(1024 * 1024)
+// Background jobs which can run at once. Starting one more job waits for
+// some of them to finish first.
+#define JOBS_MAX_RUNNING	64
+// Finished jobs are kept for 'jobs' and 'wait' until there are this many.
+#define JOBS_MAX		256
+// Pipes between commands get this big buffer, so bulk data goes through
+// them with fewer context switches.
+#define PIPE_BUFFER_SIZE	(1024 * 1024)
+// Pipelines longer than that keep default pipe buffers, big ones would run
+// into the per-user limit of pipe memory.
+#define PIPE_RESIZE_MAX_STAGES	16
+// Buffer for copying data when splice() and sendfile() can't be used.
+#define COPY_BUFFER_SIZE	(64 * 1024)
+// Most lines run at once in the parallel script mode.
+#define PARALLEL_LINES_MAX	1024
+// Exit code of a command which couldn't be found or executed, like in bash.
+#define EXIT_CODE_NOT_FOUND	127
+// Command names longer than that are cut in the profile.
+#define COMMAND_NAME_SIZE	64
+// Search path used by execvp() when PATH is not set.
+#define DEFAULT_PATH		"/bin:/usr/bin"
+// Fits "/proc/self/fd/N", the path of a process substitution.
+#define FD_PATH_SIZE		32
+// Buckets of the directory cache, a power of 2.
+#define DIR_CACHE_BUCKETS	256
+// The directory cache is dropped when it has more listings than that.
+#define DIR_CACHE_MAX		1024
 
-// Simple execution of one expression.
-static void execute_expression (struct expr *e, struct command_line* line, struct parser *p)
+// Write the whole buffer, retrying on partial writes.
+static int write_all(int fd, const char *buf, size_t size)
 {
-	// Add command as first arg, and null to end of args.
-	e->cmd.arg_capacity =  e->cmd.arg_count + 2;
-	e->cmd.args = realloc(e->cmd.args, sizeof(e->cmd.args) * e->cmd.arg_capacity);
-	e->cmd.args[e->cmd.arg_count+1] = NULL;
-	for(int i = e->cmd.arg_count-1; i >= 0; i--)
+	while (size > 0)
 	{
-		e->cmd.args[i+1] = e->cmd.args[i];
+		ssize_t rc = write(fd, buf, size);
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		buf += rc;
+		size -= rc;
 	}
-	e->cmd.args[0] = strdup(e->cmd.exe);
-	e->cmd.arg_count += 2;
-	// Handle CD exception.
-	if (!strcmp(e->cmd.exe, "cd") && e->cmd.arg_count == 3) {
-		command_line_delete(line);
-		parser_delete(p);
-		exit(CD_CODE);
+	return 0;
+}
+
+// A background command line.
+struct job {
+	int id;
+	pid_t pid;
+	// The line as text, for 'jobs' and 'fg'.
+	char *text;
+	// Monotonic start and finish time in seconds. Finish is 0 while the job
+	// is running.
+	double start;
+	double finish;
+	int status;
+};
+
+// A command found in PATH.
+struct path_entry {
+	struct path_entry *next;
+	uint32_t hash;
+	// How many times the command was run through the cache, for 'hash'.
+	int hits;
+	char *path;
+	char name[];
+};
+
+// Hash table of full paths of the commands, like in bash. execvp() tries
+// execve() on every PATH directory in each started child, while a cached
+// command is started with one execve(). The lookup is done in the shell
+// process before fork, so the children inherit the filled table.
+struct path_cache {
+	struct path_entry **buckets;
+	// Power of 2.
+	uint32_t bucket_count;
+	uint32_t count;
+	// PATH the cached entries were found in. The cache is dropped when PATH
+	// is changed.
+	char *path_var;
+};
+
+// Names in a directory, sorted, for matching globs against them.
+struct dir_listing {
+	struct dir_listing *next;
+	uint32_t hash;
+	// Mtime of the directory when it was read, and the time of reading by
+	// the coarse clock the file systems take their timestamps from.
+	struct timespec mtime;
+	struct timespec scan_time;
+	// Expansion the listing was last checked for. One expansion sees a
+	// directory once, even if the glob goes through it many times.
+	uint64_t generation;
+	char **names;
+	int count;
+	char path[];
+};
+
+// Listings of the directories globs were matched in. A loop expanding the
+// same glob again and again does a stat() per directory instead of reading
+// it. A listing is read again when the mtime of its directory changes.
+struct dir_cache {
+	struct dir_listing *buckets[DIR_CACHE_BUCKETS];
+	int count;
+	uint64_t generation;
+	uint64_t hits;
+	uint64_t scans;
+};
+
+// A foreground line started in the parallel script mode. Its output is
+// collected in a memory file and is printed when all the lines before it are
+// done, so the output is the same as when the lines run one by one.
+struct parallel_line {
+	struct command_line *line;
+	pid_t pid;
+	// Memory file with the output, -1 if the output goes to a file.
+	int out_fd;
+	bool is_finished;
+	int status;
+};
+
+// Resources used by one command of a line, for the profile.
+struct command_stats {
+	char name[COMMAND_NAME_SIZE];
+	pid_t pid;
+	// Monotonic time of the fork.
+	double start;
+	double wall;
+	// From fork() until the program is exec'd or the builtin is started.
+	double start_latency;
+	double user;
+	double sys;
+	long max_rss_kb;
+};
+
+// Commands of a line, collected by the child running it, and sent to the
+// shell with the line report.
+struct line_stats {
+	struct command_stats *commands;
+	int count;
+	int capacity;
+};
+
+// Totals of the commands with the same name.
+struct profile_entry {
+	char name[COMMAND_NAME_SIZE];
+	int count;
+	double wall;
+	double user;
+	double sys;
+	long max_rss_kb;
+	double start_latency_sum;
+	double start_latency_max;
+};
+
+// Profile of the session, written as JSON on exit. Commands are accounted
+// one by one for the lines the shell waits for. Background and parallel lines
+// are seen only in the totals of all the children.
+struct profile {
+	// Opened at start, so a 'cd' of the script does not move the file.
+	int fd;
+	double start;
+	int line_count;
+	struct profile_entry *entries;
+	int entry_count;
+	int entry_capacity;
+};
+
+// State of the shell process.
+struct shell {
+	struct parser *p;
+	struct job *jobs;
+	int job_count;
+	int job_capacity;
+	int running_job_count;
+	// SIGCHLD is blocked and delivered through this fd, so finished jobs are
+	// reaped between commands, without a signal handler.
+	int sigchld_fd;
+	sigset_t orig_sigmask;
+	// For waiting on all the commands of a pipeline at once through their
+	// pidfds. Created on first use, each process has its own.
+	int epoll_fd;
+	struct path_cache paths;
+	struct dir_cache dirs;
+	// Exit code of the last pipeline, for $?.
+	int last_status;
+	// Up to this many independent lines run at once, 1 means no parallel
+	// execution. Started lines are kept in order.
+	int max_parallel_lines;
+	struct parallel_line *parallel_lines;
+	int parallel_line_count;
+	// NULL if the profile is not collected.
+	struct profile *profile;
+};
+
+// FNV-1a.
+static uint32_t path_hash(const char *name)
+{
+	uint32_t h = 2166136261u;
+	for (; *name != '\0'; name++)
+	{
+		h = (h ^ (unsigned char)*name) * 16777619u;
 	}
-	else {
-		execvp(e->cmd.exe, e->cmd.args);
-		command_line_delete(line);
-		parser_delete(p);
-		exit(1);
+	return h;
+}
+
+static void path_cache_clear(struct path_cache *c)
+{
+	for (uint32_t i = 0; i < c->bucket_count; i++)
+	{
+		struct path_entry *e = c->buckets[i];
+		while (e != NULL)
+		{
+			struct path_entry *next = e->next;
+			free(e->path);
+			free(e);
+			e = next;
+		}
+		c->buckets[i] = NULL;
+	}
+	c->count = 0;
+}
+
+static void path_cache_destroy(struct path_cache *c)
+{
+	path_cache_clear(c);
+	free(c->buckets);
+	free(c->path_var);
+	memset(c, 0, sizeof(*c));
+}
+
+static struct path_entry **path_cache_slot(struct path_cache *c, const char *name, uint32_t hash)
+{
+	struct path_entry **slot = &c->buckets[hash & (c->bucket_count - 1)];
+	while (*slot != NULL && ((*slot)->hash != hash || strcmp((*slot)->name, name)))
+	{
+		slot = &(*slot)->next;
+	}
+	return slot;
+}
+
+static struct path_entry *path_cache_find(struct path_cache *c, const char *name)
+{
+	if (c->count == 0)
+	{
+		return NULL;
+	}
+	return *path_cache_slot(c, name, path_hash(name));
+}
+
+static void path_cache_remove(struct path_cache *c, const char *name)
+{
+	if (c->count == 0)
+	{
+		return;
+	}
+	struct path_entry **slot = path_cache_slot(c, name, path_hash(name));
+	struct path_entry *e = *slot;
+	if (e != NULL)
+	{
+		*slot = e->next;
+		free(e->path);
+		free(e);
+		c->count--;
+	}
+}
+
+static void path_cache_grow(struct path_cache *c)
+{
+	uint32_t new_count = c->bucket_count == 0 ? 64 : c->bucket_count * 2;
+	struct path_entry **buckets = calloc(new_count, sizeof(*buckets));
+	for (uint32_t i = 0; i < c->bucket_count; i++)
+	{
+		struct path_entry *e = c->buckets[i];
+		while (e != NULL)
+		{
+			struct path_entry *next = e->next;
+			struct path_entry **b = &buckets[e->hash & (new_count - 1)];
+			e->next = *b;
+			*b = e;
+			e = next;
+		}
+	}
+	free(c->buckets);
+	c->buckets = buckets;
+	c->bucket_count = new_count;
+}
+
+// Drops the cache if PATH is not the one the entries were found in.
+static void path_cache_check_path_var(struct path_cache *c)
+{
+	const char *path_var = getenv("PATH");
+	if (path_var == NULL)
+	{
+		path_var = DEFAULT_PATH;
+	}
+	if (c->path_var != NULL && !strcmp(c->path_var, path_var))
+	{
+		return;
+	}
+	path_cache_clear(c);
+	free(c->path_var);
+	c->path_var = strdup(path_var);
+}
+
+// Full path of the command, searched in PATH the same way execvp() does it.
+// NULL if it is not found.
+static char *path_search(const char *path_var, const char *name, bool *is_absolute)
+{
+	size_t name_len = strlen(name);
+	*is_absolute = true;
+	for (const char *dir = path_var;; dir++)
+	{
+		const char *end = strchrnul(dir, ':');
+		size_t dir_len = end - dir;
+		char *path = malloc(dir_len + name_len + 2);
+		char *pos = path;
+		if (dir_len > 0)
+		{
+			memcpy(pos, dir, dir_len);
+			pos += dir_len;
+			*pos++ = '/';
+		}
+		memcpy(pos, name, name_len + 1);
+		struct stat st;
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0)
+		{
+			*is_absolute = path[0] == '/';
+			return path;
+		}
+		free(path);
+		if (*end == '\0')
+		{
+			return NULL;
+		}
+		dir = end;
+	}
+}
+
+// Looks the command up in the cache, and in PATH if it is not cached yet.
+// Commands found by a relative PATH entry, like an empty one, depend on the
+// working directory and are not cached. Returns NULL if the command is not
+// cached.
+static struct path_entry *path_cache_lookup(struct path_cache *c, const char *name)
+{
+	uint32_t hash = path_hash(name);
+	if (c->count > 0)
+	{
+		struct path_entry *e = *path_cache_slot(c, name, hash);
+		if (e != NULL)
+		{
+			return e;
+		}
+	}
+	bool is_absolute;
+	char *path = path_search(c->path_var, name, &is_absolute);
+	if (path == NULL || !is_absolute)
+	{
+		free(path);
+		return NULL;
+	}
+	if (c->count >= c->bucket_count)
+	{
+		path_cache_grow(c);
+	}
+	size_t name_size = strlen(name) + 1;
+	struct path_entry *e = malloc(sizeof(*e) + name_size);
+	memcpy(e->name, name, name_size);
+	e->hash = hash;
+	e->hits = 0;
+	e->path = path;
+	struct path_entry **b = &c->buckets[hash & (c->bucket_count - 1)];
+	e->next = *b;
+	*b = e;
+	c->count++;
+	return e;
+}
+
+static void dir_listing_free_names(struct dir_listing *l)
+{
+	for (int i = 0; i < l->count; i++)
+	{
+		free(l->names[i]);
+	}
+	free(l->names);
+	l->names = NULL;
+	l->count = 0;
+}
+
+static void dir_cache_clear(struct dir_cache *c)
+{
+	for (int i = 0; i < DIR_CACHE_BUCKETS; i++)
+	{
+		struct dir_listing *l = c->buckets[i];
+		while (l != NULL)
+		{
+			struct dir_listing *next = l->next;
+			dir_listing_free_names(l);
+			free(l);
+			l = next;
+		}
+		c->buckets[i] = NULL;
+	}
+	c->count = 0;
+}
+
+static int timespec_compare(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec)
+	{
+		return a->tv_sec < b->tv_sec ? -1 : 1;
+	}
+	if (a->tv_nsec != b->tv_nsec)
+	{
+		return a->tv_nsec < b->tv_nsec ? -1 : 1;
+	}
+	return 0;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Reads the names of the directory, without "." and "..". Returns false if
+// it can't be read.
+static bool dir_listing_scan(struct dir_listing *l)
+{
+	dir_listing_free_names(l);
+	DIR *dir = opendir(l->path);
+	if (dir == NULL)
+	{
+		return false;
+	}
+	// Not NULL even for an empty directory, NULL names mean a failed read.
+	int capacity = 16;
+	l->names = malloc(capacity * sizeof(*l->names));
+	struct dirent *de;
+	while ((de = readdir(dir)) != NULL)
+	{
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+		{
+			continue;
+		}
+		if (l->count == capacity)
+		{
+			capacity *= 2;
+			l->names = realloc(l->names, capacity * sizeof(*l->names));
+		}
+		l->names[l->count++] = strdup(de->d_name);
+	}
+	closedir(dir);
+	qsort(l->names, l->count, sizeof(*l->names), compare_names);
+	return true;
+}
+
+// Starts an expansion. The listings are not freed until the next one, so a
+// glob can go through them while it looks into more directories.
+static void dir_cache_start(struct dir_cache *c)
+{
+	if (c->count >= DIR_CACHE_MAX)
+	{
+		dir_cache_clear(c);
+	}
+	c->generation++;
+}
+
+// The listing of the directory, read again if the directory has changed since
+// the last time. NULL if it can't be read.
+static const struct dir_listing *dir_cache_get(struct dir_cache *c, const char *path)
+{
+	uint32_t hash = path_hash(path);
+	struct dir_listing **b = &c->buckets[hash & (DIR_CACHE_BUCKETS - 1)];
+	struct dir_listing *l = *b;
+	while (l != NULL && (l->hash != hash || strcmp(l->path, path)))
+	{
+		l = l->next;
+	}
+	if (l != NULL && l->generation == c->generation)
+	{
+		c->hits++;
+		return l->names != NULL ? l : NULL;
+	}
+	struct stat st;
+	if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+	{
+		return NULL;
+	}
+	// A change in the same clock tick as the reading can leave the mtime as
+	// it was. Only the listings read after the tick of their mtime are
+	// trusted.
+	if (l != NULL && l->names != NULL && timespec_compare(&l->mtime, &st.st_mtim) == 0
+		&& timespec_compare(&l->mtime, &l->scan_time) < 0)
+	{
+		l->generation = c->generation;
+		c->hits++;
+		return l;
+	}
+	if (l == NULL)
+	{
+		size_t path_size = strlen(path) + 1;
+		l = calloc(1, sizeof(*l) + path_size);
+		memcpy(l->path, path, path_size);
+		l->hash = hash;
+		l->next = *b;
+		*b = l;
+		c->count++;
+	}
+	clock_gettime(CLOCK_REALTIME_COARSE, &l->scan_time);
+	l->mtime = st.st_mtim;
+	l->generation = c->generation;
+	c->scans++;
+	return dir_listing_scan(l) ? l : NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double timeval_seconds(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+// Starts accounting of a command. Returns its index, the array can move.
+static int line_stats_add(struct line_stats *stats, const char *name)
+{
+	if (stats->count == stats->capacity)
+	{
+		stats->capacity = (stats->capacity + 1) * 2;
+		stats->commands = realloc(stats->commands, stats->capacity * sizeof(*stats->commands));
+	}
+	struct command_stats *cs = &stats->commands[stats->count];
+	memset(cs, 0, sizeof(*cs));
+	snprintf(cs->name, sizeof(cs->name), "%s", name);
+	cs->start = now();
+	return stats->count++;
+}
+
+// Waits for a process of the line and accounts its resources, if the stats
+// are collected.
+static int wait_command(pid_t pid, struct line_stats *stats)
+{
+	int wstatus = 0;
+	struct rusage ru;
+	if (wait4(pid, &wstatus, 0, &ru) != pid || stats == NULL)
+	{
+		return wstatus;
+	}
+	for (int i = stats->count - 1; i >= 0; i--)
+	{
+		struct command_stats *cs = &stats->commands[i];
+		if (cs->pid == pid)
+		{
+			cs->wall = now() - cs->start;
+			cs->user = timeval_seconds(&ru.ru_utime);
+			cs->sys = timeval_seconds(&ru.ru_stime);
+			cs->max_rss_kb = ru.ru_maxrss;
+			break;
+		}
+	}
+	return wstatus;
+}
+
+static void profile_add(struct profile *p, const struct command_stats *cs)
+{
+	struct profile_entry *e = NULL;
+	for (int i = 0; i < p->entry_count && e == NULL; i++)
+	{
+		if (!strcmp(p->entries[i].name, cs->name))
+		{
+			e = &p->entries[i];
+		}
+	}
+	if (e == NULL)
+	{
+		if (p->entry_count == p->entry_capacity)
+		{
+			p->entry_capacity = (p->entry_capacity + 1) * 2;
+			p->entries = realloc(p->entries, p->entry_capacity * sizeof(*p->entries));
+		}
+		e = &p->entries[p->entry_count++];
+		memset(e, 0, sizeof(*e));
+		memcpy(e->name, cs->name, sizeof(e->name));
+	}
+	e->count++;
+	e->wall += cs->wall;
+	e->user += cs->user;
+	e->sys += cs->sys;
+	if (cs->max_rss_kb > e->max_rss_kb)
+	{
+		e->max_rss_kb = cs->max_rss_kb;
+	}
+	e->start_latency_sum += cs->start_latency;
+	if (cs->start_latency > e->start_latency_max)
+	{
+		e->start_latency_max = cs->start_latency;
+	}
+}
+
+static void json_write_string(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for (; *str != '\0'; str++)
+	{
+		unsigned char c = *str;
+		if (c == '"' || c == '\\')
+		{
+			fprintf(f, "\\%c", c);
+		}
+		else if (c < 0x20)
+		{
+			fprintf(f, "\\u%04x", c);
+		}
+		else
+		{
+			fputc(c, f);
+		}
+	}
+	fputc('"', f);
+}
+
+static void json_write_usage(FILE *f, const char *name, int who)
+{
+	struct rusage ru;
+	getrusage(who, &ru);
+	fprintf(f, "  \"%s\": {\"user\": %.6f, \"sys\": %.6f, \"max_rss_kb\": %ld},\n",
+		name, timeval_seconds(&ru.ru_utime), timeval_seconds(&ru.ru_stime), ru.ru_maxrss);
+}
+
+// Writes the profile as JSON. Times are in seconds.
+static void profile_write(struct profile *p, const struct parser_stats *parser_stats,
+			  const struct dir_cache *dirs)
+{
+	FILE *f = fdopen(p->fd, "w");
+	if (f == NULL)
+	{
+		fprintf(stderr, "profile: %s\n", strerror(errno));
+		return;
+	}
+	p->fd = -1;
+	fprintf(f, "{\n  \"wall\": %.6f,\n  \"lines\": %d,\n", now() - p->start, p->line_count);
+	json_write_usage(f, "shell", RUSAGE_SELF);
+	json_write_usage(f, "children", RUSAGE_CHILDREN);
+	uint64_t lookups = parser_stats->plan_hits + parser_stats->plan_misses;
+	fprintf(f, "  \"plan_cache\": {\"hits\": %llu, \"misses\": %llu, \"hit_rate\": %.4f},\n",
+		(unsigned long long)parser_stats->plan_hits, (unsigned long long)parser_stats->plan_misses,
+		lookups > 0 ? (double)parser_stats->plan_hits / lookups : 0.0);
+	fprintf(f, "  \"dir_cache\": {\"hits\": %llu, \"scans\": %llu},\n",
+		(unsigned long long)dirs->hits, (unsigned long long)dirs->scans);
+	fprintf(f, "  \"commands\": [");
+	for (int i = 0; i < p->entry_count; i++)
+	{
+		const struct profile_entry *e = &p->entries[i];
+		fprintf(f, "%s\n    {\"name\": ", i > 0 ? "," : "");
+		json_write_string(f, e->name);
+		fprintf(f, ", \"count\": %d, \"wall\": %.6f, \"user\": %.6f, \"sys\": %.6f, "
+			"\"max_rss_kb\": %ld, \"start_latency_avg\": %.6f, \"start_latency_max\": %.6f}",
+			e->count, e->wall, e->user, e->sys, e->max_rss_kb,
+			e->start_latency_sum / e->count, e->start_latency_max);
+	}
+	fprintf(f, "\n  ]\n}\n");
+	fclose(f);
+}
+
+static void shell_create(struct shell *sh)
+{
+	memset(sh, 0, sizeof(*sh));
+	sh->p = parser_new();
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &set, &sh->orig_sigmask);
+	sh->sigchld_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+	sh->epoll_fd = -1;
+}
+
+// Frees everything the shell owns. Is called in forked children as well.
+static void shell_destroy(struct shell *sh)
+{
+	for (int i = 0; i < sh->job_count; i++)
+	{
+		free(sh->jobs[i].text);
+	}
+	free(sh->jobs);
+	for (int i = 0; i < sh->parallel_line_count; i++)
+	{
+		command_line_delete(sh->parallel_lines[i].line);
+		if (sh->parallel_lines[i].out_fd != -1)
+		{
+			close(sh->parallel_lines[i].out_fd);
+		}
+	}
+	free(sh->parallel_lines);
+	if (sh->profile != NULL)
+	{
+		if (sh->profile->fd != -1)
+		{
+			close(sh->profile->fd);
+		}
+		free(sh->profile->entries);
+		free(sh->profile);
+	}
+	path_cache_destroy(&sh->paths);
+	dir_cache_clear(&sh->dirs);
+	if (sh->sigchld_fd != -1)
+	{
+		close(sh->sigchld_fd);
+	}
+	if (sh->epoll_fd != -1)
+	{
+		close(sh->epoll_fd);
+	}
+	parser_delete(sh->p);
+}
+
+// Fork from the shell process. The child gets the original signal mask back,
+// otherwise the programs it runs would inherit blocked SIGCHLD. The buffered
+// output of the shell is flushed first, or a child ending with exit() would
+// write it once more into its own stdout.
+static pid_t shell_fork(struct shell *sh)
+{
+	fflush(stdout);
+	fflush(stderr);
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		sigprocmask(SIG_SETMASK, &sh->orig_sigmask, NULL);
+		if (sh->sigchld_fd != -1)
+		{
+			close(sh->sigchld_fd);
+			sh->sigchld_fd = -1;
+		}
+		// A shared epoll set would get the events of the parent's pidfds.
+		if (sh->epoll_fd != -1)
+		{
+			close(sh->epoll_fd);
+			sh->epoll_fd = -1;
+		}
+	}
+	return pid;
+}
+
+static int wait_status_to_exit_code(int wstatus)
+{
+	if (WIFSIGNALED(wstatus))
+	{
+		return 128 + WTERMSIG(wstatus);
+	}
+	return WEXITSTATUS(wstatus);
+}
+
+static struct job *shell_find_job(struct shell *sh, pid_t pid)
+{
+	for (int i = 0; i < sh->job_count; i++)
+	{
+		if (sh->jobs[i].pid == pid)
+		{
+			return &sh->jobs[i];
+		}
+	}
+	return NULL;
+}
+
+static void job_finish(struct shell *sh, struct job *j, int wstatus)
+{
+	j->finish = now();
+	j->status = wait_status_to_exit_code(wstatus);
+	sh->running_job_count--;
+}
+
+static void shell_remove_job(struct shell *sh, struct job *j)
+{
+	free(j->text);
+	int i = j - sh->jobs;
+	memmove(j, j + 1, (sh->job_count - i - 1) * sizeof(*j));
+	sh->job_count--;
+}
+
+// Reap finished background jobs. Without blocking it only looks at the
+// SIGCHLD fd, so it costs one failed read() when nothing has finished.
+// Blocking mode waits for at least one job to finish.
+static void shell_reap_jobs(struct shell *sh, bool block)
+{
+	if (sh->running_job_count == 0)
+	{
+		return;
+	}
+	if (!block)
+	{
+		struct signalfd_siginfo info;
+		bool has_signal = false;
+		while (read(sh->sigchld_fd, &info, sizeof(info)) == sizeof(info))
+		{
+			has_signal = true;
+		}
+		if (!has_signal)
+		{
+			return;
+		}
+	}
+	int wstatus;
+	pid_t pid;
+	while ((pid = waitpid(-1, &wstatus, block ? 0 : WNOHANG)) > 0)
+	{
+		struct job *j = shell_find_job(sh, pid);
+		if (j != NULL)
+		{
+			job_finish(sh, j, wstatus);
+		}
+		else
+		{
+			// Not a job, but a line of the parallel script mode.
+			for (int i = 0; i < sh->parallel_line_count; i++)
+			{
+				struct parallel_line *pl = &sh->parallel_lines[i];
+				if (pl->pid == pid)
+				{
+					pl->is_finished = true;
+					pl->status = wait_status_to_exit_code(wstatus);
+				}
+			}
+		}
+		if (block)
+		{
+			break;
+		}
+	}
+}
+
+static char *job_text(const struct command_line *line)
+{
+	size_t size = 3;
+	for (const struct expr *e = line->head; e != NULL; e = e->next)
+	{
+		if (e->type != EXPR_TYPE_COMMAND)
+		{
+			size += 4;
+			continue;
+		}
+		for (uint32_t i = 0; i <= e->cmd.arg_count; i++)
+		{
+			size += strlen(e->cmd.argv[i]) + 1;
+		}
+	}
+	char *text = malloc(size);
+	char *pos = text;
+	for (const struct expr *e = line->head; e != NULL; e = e->next)
+	{
+		if (e->type == EXPR_TYPE_PIPE)
+		{
+			pos = stpcpy(pos, "| ");
+		}
+		else if (e->type == EXPR_TYPE_AND)
+		{
+			pos = stpcpy(pos, "&& ");
+		}
+		else if (e->type == EXPR_TYPE_OR)
+		{
+			pos = stpcpy(pos, "|| ");
+		}
+		else
+		{
+			for (uint32_t i = 0; i <= e->cmd.arg_count; i++)
+			{
+				pos = stpcpy(pos, e->cmd.argv[i]);
+				*pos++ = ' ';
+			}
+		}
+	}
+	strcpy(pos, "&");
+	return text;
+}
+
+static void shell_add_job(struct shell *sh, pid_t pid, const struct command_line *line)
+{
+	// Forget the oldest finished jobs nobody asked about.
+	for (int i = 0; i < sh->job_count && sh->job_count >= JOBS_MAX;)
+	{
+		if (sh->jobs[i].finish != 0)
+		{
+			shell_remove_job(sh, &sh->jobs[i]);
+		}
+		else
+		{
+			i++;
+		}
+	}
+	if (sh->job_count == sh->job_capacity)
+	{
+		sh->job_capacity = (sh->job_capacity + 1) * 2;
+		sh->jobs = realloc(sh->jobs, sh->job_capacity * sizeof(*sh->jobs));
+	}
+	struct job *j = &sh->jobs[sh->job_count++];
+	j->id = sh->job_count > 1 ? j[-1].id + 1 : 1;
+	j->pid = pid;
+	j->text = job_text(line);
+	j->start = now();
+	j->finish = 0;
+	j->status = 0;
+	sh->running_job_count++;
+}
+
+// Job by "%id", "%%", "%+" or pid. The last started one if there is no spec.
+static struct job *shell_job_by_spec(struct shell *sh, const char *spec)
+{
+	if (sh->job_count == 0)
+	{
+		return NULL;
+	}
+	if (spec == NULL || !strcmp(spec, "%%") || !strcmp(spec, "%+"))
+	{
+		return &sh->jobs[sh->job_count - 1];
+	}
+	char *end;
+	long n = strtol(spec[0] == '%' ? spec + 1 : spec, &end, 10);
+	if (*end != '\0')
+	{
+		return NULL;
+	}
+	for (int i = 0; i < sh->job_count; i++)
+	{
+		if ((spec[0] == '%' && sh->jobs[i].id == n) || (spec[0] != '%' && sh->jobs[i].pid == n))
+		{
+			return &sh->jobs[i];
+		}
+	}
+	return NULL;
+}
+
+// Block until the job is finished. Returns its exit code.
+static int shell_wait_job(struct shell *sh, struct job *j)
+{
+	if (j->finish == 0)
+	{
+		int wstatus;
+		if (waitpid(j->pid, &wstatus, 0) == j->pid)
+		{
+			job_finish(sh, j, wstatus);
+		}
+		else
+		{
+			// Not a child of this process, like in a pipeline stage.
+			return 127;
+		}
+	}
+	return j->status;
+}
+
+// Builtins get the command and the fd to print into, and return the exit
+// status of the command. None of them forks.
+typedef int (*builtin_f)(struct shell *sh, const struct command *cmd, int out_fd);
+
+static int builtin_cd(struct shell *sh, const struct command *cmd, int out_fd)
+{
+	(void)sh;
+	(void)out_fd;
+	const char *dir;
+	if (cmd->arg_count > 1)
+	{
+		fprintf(stderr, "cd: too many arguments\n");
+		return 1;
+	}
+	if (cmd->arg_count == 1)
+	{
+		dir = cmd->args[0];
+	}
+	else
+	{
+		dir = getenv("HOME");
+		if (dir == NULL)
+		{
+			fprintf(stderr, "cd: HOME not set\n");
+			return 1;
+		}
+	}
+	if (chdir(dir) != 0)
+	{
+		fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+static int builtin_exit(struct shell *sh, const struct command *cmd, int out_fd)
+{
+	(void)sh;
+	(void)out_fd;
+	if (cmd->arg_count == 0)
+	{
+		return 0;
+	}
+	char *end;
+	return (int)(strtol(cmd->args[0], &end, 0) & 0xff);
+}
+
+static int builtin_true(struct shell *sh, const struct command *cmd, int out_fd)
+{
+	(void)sh;
+	(void)cmd;
+	(void)out_fd;
+	return 0;
+}
+
+static int builtin_false(struct shell *sh, const struct command *cmd, int out_fd)
+{
+	(void)sh;
+	(void)cmd;
+	(void)out_fd;
+	return 1;
+}
+
+// Same as coreutils echo: leading -n, -e, -E flags (possibly combined) are
+// options, everything else is printed as is.
+static int builtin_echo(struct shell *sh, const struct command *cmd, int out_fd)
+{
+	(void)sh;
+	bool newline = true, escapes = false;
+	uint32_t i = 0;
+	for (; i < cmd->arg_count; i++)
+	{
+		const char *a = cmd->args[i];
+		if (a[0] != '-' || a[1] == '\0' || strspn(a + 1, "neE") != strlen(a + 1))
+		{
+			break;
+		}
+		for (a++; *a; a++)
+		{
+			if (*a == 'n')
+			{
+				newline = false;
+			}
+			else
+			{
+				escapes = *a == 'e';
+			}
+		}
+	}
+	size_t size = 0;
+	for (uint32_t j = i; j < cmd->arg_count; j++)
+	{
+		size += strlen(cmd->args[j]) + 1;
+	}
+	char *buf = malloc(size + 1);
+	char *pos = buf;
+	for (; i < cmd->arg_count; i++)
+	{
+		const char *a = cmd->args[i];
+		if (!escapes)
+		{
+			size_t len = strlen(a);
+			memcpy(pos, a, len);
+			pos += len;
+		}
+		else
+		{
+			for (; *a; a++)
+			{
+				if (*a != '\\' || a[1] == '\0')
+				{
+					*pos++ = *a;
+					continue;
+				}
+				switch (*++a)
+				{
+				case 'a': *pos++ = '\a'; break;
+				case 'b': *pos++ = '\b'; break;
+				case 'e': *pos++ = 033; break;
+				case 'f': *pos++ = '\f'; break;
+				case 'n': *pos++ = '\n'; break;
+				case 'r': *pos++ = '\r'; break;
+				case 't': *pos++ = '\t'; break;
+				case 'v': *pos++ = '\v'; break;
+				case '\\': *pos++ = '\\'; break;
+				case 'c':
+					// \c stops all the output, including the newline.
+					write_all(out_fd, buf, pos - buf);
+					free(buf);
+					return 0;
+				default:
+					*pos++ = '\\';
+					*pos++ = *a;
+					break;
+				}
+			}
+		}
+		if (i + 1 < cmd->arg_count)
+		{
+			*pos++ = ' ';
+		}
+	}
+	if (newline)
+	{
+		*pos++ = '\n';
+	}
+	int rc = write_all(out_fd, buf, pos - buf) == 0 ? 0 : 1;
+	free(buf);
+	return rc;
+}
+
+static int builtin_jobs(struct shell *sh, const struct command *cmd, int out_fd)
+{
+	(void)cmd;
+	shell_reap_jobs(sh, false);
+	double t = now();
+	for (int i = 0; i < sh->job_count;)
+	{
+		struct job *j = &sh->jobs[i];
+		char state[32];
+		double elapsed;
+		if (j->finish == 0)
+		{
+			strcpy(state, "Running");
+			elapsed = t - j->start;
+		}
+		else
+		{
+			if (j->status == 0)
+			{
+				strcpy(state, "Done");
+			}
+			else
+			{
+				sprintf(state, "Exit %d", j->status);
+			}
+			elapsed = j->finish - j->start;
+		}
+		dprintf(out_fd, "[%d]  %-10s %9.3fs  %s\n", j->id, state, elapsed, j->text);
+		// Finished jobs are reported once.
+		if (j->finish != 0)
+		{
+			shell_remove_job(sh, j);
+		}
+		else
+		{
+			i++;
+		}
+	}
+	return 0;
+}
+
+static int builtin_wait(struct shell *sh, const struct command *cmd, int out_fd)
+{
+	(void)out_fd;
+	if (cmd->arg_count == 0)
+	{
+		while (sh->job_count > 0)
+		{
+			shell_wait_job(sh, &sh->jobs[0]);
+			shell_remove_job(sh, &sh->jobs[0]);
+		}
+		return 0;
+	}
+	int status = 0;
+	for (uint32_t i = 0; i < cmd->arg_count; i++)
+	{
+		struct job *j = shell_job_by_spec(sh, cmd->args[i]);
+		if (j == NULL)
+		{
+			fprintf(stderr, "wait: %s: no such job\n", cmd->args[i]);
+			status = 127;
+			continue;
+		}
+		status = shell_wait_job(sh, j);
+		shell_remove_job(sh, j);
+	}
+	return status;
+}
+
+// There is no terminal control, so bringing a job to foreground means
+// waiting for it like for a foreground command.
+static int builtin_fg(struct shell *sh, const struct command *cmd, int out_fd)
+{
+	const char *spec = cmd->arg_count > 0 ? cmd->args[0] : NULL;
+	struct job *j = shell_job_by_spec(sh, spec);
+	if (j == NULL)
+	{
+		fprintf(stderr, "fg: %s: no such job\n", spec != NULL ? spec : "current");
+		return 1;
+	}
+	dprintf(out_fd, "%.*s\n", (int)strlen(j->text) - 2, j->text);
+	int status = shell_wait_job(sh, j);
+	shell_remove_job(sh, j);
+	return status;
+}
+
+// Move all data from one fd to another. splice() moves the pages when one of
+// the fds is a pipe, copy_file_range() and sendfile() copy files inside the
+// kernel. Only if none of them works, the data goes through a buffer in
+// userspace.
+static int copy_fd(int in_fd, int out_fd)
+{
+	ssize_t rc;
+	while ((rc = splice(in_fd, NULL, out_fd, NULL, PIPE_BUFFER_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0)
+		;
+	if (rc == 0)
+	{
+		return 0;
+	}
+	if (errno != EINVAL)
+	{
+		return -1;
+	}
+	while ((rc = copy_file_range(in_fd, NULL, out_fd, NULL, SIZE_MAX >> 1, 0)) > 0)
+		;
+	if (rc == 0)
+	{
+		return 0;
+	}
+	if (errno != EINVAL && errno != EXDEV && errno != ENOSYS && errno != EBADF)
+	{
+		return -1;
+	}
+	while ((rc = sendfile(out_fd, in_fd, NULL, PIPE_BUFFER_SIZE)) > 0)
+		;
+	if (rc == 0)
+	{
+		return 0;
+	}
+	if (errno != EINVAL && errno != ENOSYS)
+	{
+		return -1;
+	}
+	char *buf = malloc(COPY_BUFFER_SIZE);
+	while ((rc = read(in_fd, buf, COPY_BUFFER_SIZE)) > 0)
+	{
+		if (write_all(out_fd, buf, rc) != 0)
+		{
+			rc = -1;
+			break;
+		}
+	}
+	free(buf);
+	return rc == 0 ? 0 : -1;
+}
+
+// cat without options. Data never goes through the shell's memory.
+static int builtin_cat(struct shell *sh, const struct command *cmd, int out_fd)
+{
+	(void)sh;
+	if (cmd->arg_count == 0)
+	{
+		return copy_fd(STDIN_FILENO, out_fd) == 0 ? 0 : 1;
+	}
+	int status = 0;
+	for (uint32_t i = 0; i < cmd->arg_count; i++)
+	{
+		const char *name = cmd->args[i];
+		int in_fd = STDIN_FILENO;
+		if (strcmp(name, "-") != 0)
+		{
+			in_fd = open(name, O_RDONLY | O_CLOEXEC);
+			if (in_fd == -1)
+			{
+				fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+				status = 1;
+				continue;
+			}
+		}
+		if (copy_fd(in_fd, out_fd) != 0)
+		{
+			fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+			status = 1;
+		}
+		if (in_fd != STDIN_FILENO)
+		{
+			close(in_fd);
+		}
+	}
+	return status;
+}
+
+// Options are left to the real cat.
+static bool builtin_cat_accepts(const struct command *cmd)
+{
+	for (uint32_t i = 0; i < cmd->arg_count; i++)
+	{
+		if (cmd->args[i][0] == '-' && cmd->args[i][1] != '\0')
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static int builtin_pwd(struct shell *sh, const struct command *cmd, int out_fd)
+{
+	(void)sh;
+	(void)cmd;
+	char *dir = getcwd(NULL, 0);
+	if (dir == NULL)
+	{
+		fprintf(stderr, "pwd: %s\n", strerror(errno));
+		return 1;
+	}
+	size_t len = strlen(dir);
+	dir[len] = '\n';
+	int rc = write_all(out_fd, dir, len + 1) == 0 ? 0 : 1;
+	free(dir);
+	return rc;
+}
+
+// 'hash' lists the cached command paths, 'hash -r' forgets them, 'hash name'
+// finds and caches the command.
+static int builtin_hash(struct shell *sh, const struct command *cmd, int out_fd)
+{
+	struct path_cache *c = &sh->paths;
+	path_cache_check_path_var(c);
+	if (cmd->arg_count > 0 && !strcmp(cmd->args[0], "-r"))
+	{
+		path_cache_clear(c);
+		return 0;
+	}
+	if (cmd->arg_count > 0)
+	{
+		int rc = 0;
+		for (uint32_t i = 0; i < cmd->arg_count; i++)
+		{
+			if (strchr(cmd->args[i], '/') != NULL)
+			{
+				continue;
+			}
+			if (path_cache_lookup(c, cmd->args[i]) == NULL)
+			{
+				fprintf(stderr, "hash: %s: not found\n", cmd->args[i]);
+				rc = 1;
+			}
+		}
+		return rc;
+	}
+	if (c->count == 0)
+	{
+		const char msg[] = "hash: hash table empty\n";
+		return write_all(out_fd, msg, sizeof(msg) - 1) == 0 ? 0 : 1;
+	}
+	FILE *out = fdopen(dup(out_fd), "w");
+	if (out == NULL)
+	{
+		return 1;
+	}
+	fprintf(out, "hits\tcommand\n");
+	for (uint32_t i = 0; i < c->bucket_count; i++)
+	{
+		for (struct path_entry *e = c->buckets[i]; e != NULL; e = e->next)
+		{
+			fprintf(out, "%4d\t%s\n", e->hits, e->path);
+		}
+	}
+	return fclose(out) == 0 ? 0 : 1;
+}
+
+// Builtins which change the shell process itself (cd, exit, wait, fg) work
+// on a short-lived child copy of the shell inside a pipeline, like in bash.
+struct builtin {
+	const char *name;
+	builtin_f run;
+	// If set, the builtin is used only for the commands it accepts. Others
+	// are executed as usual programs.
+	bool (*accepts)(const struct command *cmd);
+	// The builtin reads or changes the state of the shell, so the lines
+	// with it can't run in parallel with others.
+	bool uses_shell;
+};
+
+static const struct builtin builtins[] = {
+	{"cd", builtin_cd, NULL, true},
+	{"exit", builtin_exit, NULL, true},
+	{"true", builtin_true, NULL, false},
+	{"false", builtin_false, NULL, false},
+	{"echo", builtin_echo, NULL, false},
+	{"pwd", builtin_pwd, NULL, false},
+	{"jobs", builtin_jobs, NULL, true},
+	{"wait", builtin_wait, NULL, true},
+	{"fg", builtin_fg, NULL, true},
+	{"hash", builtin_hash, NULL, true},
+	{"cat", builtin_cat, builtin_cat_accepts, false},
+};
+
+static const struct builtin *find_builtin(const struct command *cmd)
+{
+	for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+	{
+		if (!strcmp(builtins[i].name, cmd->exe))
+		{
+			if (builtins[i].accepts != NULL && !builtins[i].accepts(cmd))
+			{
+				return NULL;
+			}
+			return &builtins[i];
+		}
+	}
+	return NULL;
+}
+
+// Simple execution of one expression. Builtins are run right in the forked
+// child without exec.
+static void execute_expression (struct expr *e, struct command_line* line, struct shell *sh)
+{
+	const struct builtin *b = find_builtin(&e->cmd);
+	if (b != NULL)
+	{
+		int status = b->run(sh, &e->cmd, STDOUT_FILENO);
+		command_line_delete(line);
+		shell_destroy(sh);
+		exit(status);
+	}
+	if (strchr(e->cmd.exe, '/') == NULL)
+	{
+		struct path_entry *pe = path_cache_find(&sh->paths, e->cmd.exe);
+		if (pe != NULL)
+		{
+			execve(pe->path, e->cmd.argv, environ);
+			// The file is gone or changed, search PATH again.
+		}
+	}
+	execvp(e->cmd.exe, e->cmd.argv);
+	command_line_delete(line);
+	shell_destroy(sh);
+	exit(EXIT_CODE_NOT_FOUND);
+}
+
+// The name of the program is known only when the command is started.
+static bool command_expands_name(const struct command *cmd)
+{
+	return cmd->expansion_count > 0 && cmd->expansions[0].index == 0;
+}
+
+// Finds the programs of the line in PATH and caches their paths before the
+// line is forked, so the children can exec them right away.
+static void shell_hash_line(struct shell *sh, const struct command_line *line)
+{
+	path_cache_check_path_var(&sh->paths);
+	for (const struct expr *e = line->head; e != NULL; e = e->next)
+	{
+		if (e->type != EXPR_TYPE_COMMAND || strchr(e->cmd.exe, '/') != NULL
+			|| find_builtin(&e->cmd) != NULL || command_expands_name(&e->cmd))
+		{
+			continue;
+		}
+		struct path_entry *pe = path_cache_lookup(&sh->paths, e->cmd.exe);
+		if (pe != NULL)
+		{
+			pe->hits++;
+		}
+	}
+}
+
+// Forgets the programs of a line which failed to start something, so they
+// are searched in PATH again next time.
+static void shell_unhash_line(struct shell *sh, const struct command_line *line)
+{
+	for (const struct expr *e = line->head; e != NULL; e = e->next)
+	{
+		if (e->type == EXPR_TYPE_COMMAND)
+		{
+			path_cache_remove(&sh->paths, e->cmd.exe);
+		}
+	}
+}
+
+// Growing text, always terminated by zero.
+struct text {
+	char *data;
+	size_t size;
+	size_t capacity;
+};
+
+static void text_append(struct text *t, const char *data, size_t size)
+{
+	if (t->size + size + 1 > t->capacity)
+	{
+		size_t capacity = t->capacity == 0 ? 64 : t->capacity;
+		while (capacity < t->size + size + 1)
+		{
+			capacity *= 2;
+		}
+		t->data = realloc(t->data, capacity);
+		t->capacity = capacity;
+	}
+	if (size > 0)
+	{
+		memcpy(t->data + t->size, data, size);
+	}
+	t->size += size;
+	t->data[t->size] = '\0';
+}
+
+// Words made by the expansion. They are kept one after another with their
+// zeros in one text, and are found by offsets, as the text can move.
+struct word_list {
+	struct text text;
+	size_t *offsets;
+	int count;
+	int capacity;
+};
+
+static void word_list_add(struct word_list *l, const char *word, size_t size)
+{
+	if (l->count == l->capacity)
+	{
+		l->capacity = (l->capacity + 4) * 2;
+		l->offsets = realloc(l->offsets, l->capacity * sizeof(*l->offsets));
+	}
+	l->offsets[l->count++] = l->text.size;
+	text_append(&l->text, word, size);
+	// The word's zero is a part of the text.
+	l->text.size++;
+}
+
+static void word_list_destroy(struct word_list *l)
+{
+	free(l->text.data);
+	free(l->offsets);
+}
+
+// Appends chars which are never special: to the value as they are, and to
+// the glob pattern escaped.
+static void append_literal(struct text *value, struct text *pattern, const char *s, size_t size)
+{
+	text_append(value, s, size);
+	for (size_t i = 0; i < size; i++)
+	{
+		if (s[i] == '*' || s[i] == '?' || s[i] == '[' || s[i] == '\\')
+		{
+			text_append(pattern, "\\", 1);
+		}
+		text_append(pattern, &s[i], 1);
+	}
+}
+
+// Appends the value of $NAME, ${NAME} or $? at pos, which points at '$'.
+// Returns the position after the variable. A '$' not followed by a name is
+// kept as is.
+static const char *expand_variable(const struct shell *sh, const char *pos, struct text *value,
+				   struct text *pattern)
+{
+	const char *name = pos + 1;
+	if (*name == '?')
+	{
+		char code[16];
+		int size = snprintf(code, sizeof(code), "%d", sh->last_status);
+		append_literal(value, pattern, code, size);
+		return name + 1;
+	}
+	bool has_braces = *name == '{';
+	if (has_braces)
+	{
+		name++;
+	}
+	const char *end = name;
+	if (isalpha((unsigned char)*end) || *end == '_')
+	{
+		while (isalnum((unsigned char)*end) || *end == '_')
+		{
+			end++;
+		}
+	}
+	if (end == name || (has_braces && *end != '}'))
+	{
+		append_literal(value, pattern, "$", 1);
+		return pos + 1;
+	}
+	char *var = strndup(name, end - name);
+	const char *v = getenv(var);
+	free(var);
+	if (v != NULL)
+	{
+		append_literal(value, pattern, v, strlen(v));
+	}
+	return has_braces ? end + 1 : end;
+}
+
+// A glob pattern component has chars to match, not only escaped ones.
+static bool is_glob_component(const char *component)
+{
+	for (const char *c = component; *c != '\0'; c++)
+	{
+		if (*c == '\\' && c[1] != '\0')
+		{
+			c++;
+		}
+		else if (*c == '*' || *c == '?' || *c == '[')
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// Appends the component to the path with the escapes removed. Returns the
+// new length of the path, 0 if it doesn't fit.
+static size_t path_append_literal(char *path, size_t path_len, const char *component)
+{
+	for (const char *c = component; *c != '\0'; c++)
+	{
+		if (*c == '\\' && c[1] != '\0')
+		{
+			c++;
+		}
+		if (path_len + 2 > PATH_MAX)
+		{
+			return 0;
+		}
+		path[path_len++] = *c;
+	}
+	path[path_len] = '\0';
+	return path_len;
+}
+
+// Adds the path of length len when it is the end of the pattern. A pattern
+// ending with '/' matches only directories.
+static int glob_add_match(char *path, size_t len, bool is_dir_only, struct word_list *out)
+{
+	struct stat st;
+	if (is_dir_only)
+	{
+		if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode) || len + 2 > PATH_MAX)
+		{
+			return 0;
+		}
+		path[len++] = '/';
+		path[len] = '\0';
+	}
+	else if (lstat(path, &st) != 0)
+	{
+		return 0;
+	}
+	word_list_add(out, path, len);
+	return 1;
+}
+
+// Matches the pattern against the paths in the directory. The path is empty
+// for the working directory, or ends with '/'. Adds the matching paths, and
+// returns how many there are. Names are matched in the sorted order, so the
+// paths are sorted too.
+static int glob_match_dir(struct shell *sh, char *path, size_t path_len, const char *pattern,
+			  struct word_list *out)
+{
+	const char *slash = strchr(pattern, '/');
+	const char *rest = NULL;
+	char *component;
+	if (slash == NULL)
+	{
+		component = strdup(pattern);
+	}
+	else
+	{
+		component = strndup(pattern, slash - pattern);
+		rest = slash;
+		while (*rest == '/')
+		{
+			rest++;
+		}
+	}
+	bool is_last = rest == NULL || *rest == '\0';
+	int found = 0;
+	if (!is_glob_component(component))
+	{
+		size_t len = path_append_literal(path, path_len, component);
+		if (len == 0)
+		{
+			// Doesn't fit.
+		}
+		else if (is_last)
+		{
+			found = glob_add_match(path, len, rest != NULL, out);
+		}
+		else if (len + 2 <= PATH_MAX)
+		{
+			path[len] = '/';
+			path[len + 1] = '\0';
+			found = glob_match_dir(sh, path, len + 1, rest, out);
+		}
+		free(component);
+		return found;
+	}
+	path[path_len] = '\0';
+	const struct dir_listing *l = dir_cache_get(&sh->dirs, path_len > 0 ? path : ".");
+	for (int i = 0; l != NULL && i < l->count; i++)
+	{
+		const char *name = l->names[i];
+		// Hidden files match only an explicit '.', like in bash.
+		if (fnmatch(component, name, FNM_PERIOD) != 0)
+		{
+			continue;
+		}
+		size_t len = path_len + strlen(name);
+		if (len + 2 > PATH_MAX)
+		{
+			continue;
+		}
+		strcpy(path + path_len, name);
+		if (is_last)
+		{
+			found += glob_add_match(path, len, rest != NULL, out);
+		}
+		else
+		{
+			path[len] = '/';
+			path[len + 1] = '\0';
+			found += glob_match_dir(sh, path, len + 1, rest, out);
+		}
+	}
+	free(component);
+	return found;
+}
+
+// Adds the paths matching the pattern. Returns how many there are.
+static int glob_expand(struct shell *sh, const char *pattern, struct word_list *out)
+{
+	char path[PATH_MAX];
+	size_t path_len = 0;
+	if (*pattern == '/')
+	{
+		path[path_len++] = '/';
+		while (*pattern == '/')
+		{
+			pattern++;
+		}
+	}
+	path[path_len] = '\0';
+	if (*pattern == '\0')
+	{
+		return 0;
+	}
+	return glob_match_dir(sh, path, path_len, pattern, out);
+}
+
+// Expands a word as written in the line: variables and $? everywhere but in
+// single quotes, and globs when they are not quoted. Quotes and backslashes
+// are removed the same way as by the parser. Values of the variables are not
+// split into words and are not globbed. Adds the words to out: none if an
+// unquoted word is empty after the expansion, many if a glob matches many
+// paths, and the word itself if it matches nothing.
+static void expand_word(struct shell *sh, const char *source, bool with_globs, struct word_list *out)
+{
+	struct text value = {NULL, 0, 0};
+	struct text pattern = {NULL, 0, 0};
+	text_append(&value, "", 0);
+	text_append(&pattern, "", 0);
+	bool is_quoted = false;
+	bool has_glob = false;
+	char quote = '\0';
+	const char *pos = source;
+	while (*pos != '\0')
+	{
+		char c = *pos;
+		if (quote == '\0' && isspace((unsigned char)c))
+		{
+			break;
+		}
+		if (c == '\'' || c == '"')
+		{
+			if (quote == '\0')
+			{
+				quote = c;
+				is_quoted = true;
+				pos++;
+				continue;
+			}
+			if (quote == c)
+			{
+				// The parser ends the word at the closing quote.
+				break;
+			}
+		}
+		else if (c == '$' && quote != '\'')
+		{
+			pos = expand_variable(sh, pos, &value, &pattern);
+			continue;
+		}
+		else if (c == '\\' && quote != '\'' && pos[1] != '\0')
+		{
+			char next = pos[1];
+			if (next == '\n')
+			{
+				pos += 2;
+				continue;
+			}
+			if (quote == '\0' || next == '\\' || next == '"' || next == '$')
+			{
+				append_literal(&value, &pattern, &next, 1);
+				pos += 2;
+				continue;
+			}
+		}
+		else if (quote == '\0' && with_globs && (c == '*' || c == '?' || c == '['))
+		{
+			text_append(&value, &c, 1);
+			text_append(&pattern, &c, 1);
+			has_glob = true;
+			pos++;
+			continue;
+		}
+		append_literal(&value, &pattern, &c, 1);
+		pos++;
+	}
+	if (has_glob && glob_expand(sh, pattern.data, out) > 0)
+	{
+		// The matches are the words.
+	}
+	else if (value.size > 0 || is_quoted)
+	{
+		word_list_add(out, value.data, value.size);
+	}
+	free(value.data);
+	free(pattern.data);
+}
+
+// A command with the words expanded, made when the command is started. The
+// parsed line can't be changed, it can be shared with the plan cache, so the
+// expression is a copy with its own argv.
+struct expanded_command {
+	struct expr e;
+	struct word_list words;
+	char **argv;
+	uint32_t *substs;
+};
+
+// Expands the words of the command. Returns the expression to run, which is
+// e itself if there is nothing to expand.
+static const struct expr *expand_command(struct shell *sh, const struct expr *e, struct expanded_command *ex)
+{
+	memset(ex, 0, sizeof(*ex));
+	const struct command *cmd = &e->cmd;
+	if (cmd->expansion_count == 0)
+	{
+		return e;
+	}
+	dir_cache_start(&sh->dirs);
+	ex->e = *e;
+	if (cmd->subst_count > 0)
+	{
+		ex->substs = malloc(cmd->subst_count * sizeof(*ex->substs));
+	}
+	uint32_t next_expansion = 0;
+	uint32_t next_subst = 0;
+	for (uint32_t i = 0; i <= cmd->arg_count; i++)
+	{
+		if (next_expansion < cmd->expansion_count && cmd->expansions[next_expansion].index == i)
+		{
+			expand_word(sh, cmd->expansions[next_expansion++].source, true, &ex->words);
+			continue;
+		}
+		if (next_subst < cmd->subst_count && cmd->substs[next_subst] == i)
+		{
+			ex->substs[next_subst++] = ex->words.count;
+		}
+		word_list_add(&ex->words, cmd->argv[i], strlen(cmd->argv[i]));
+	}
+	// All the words were empty variables. Like in bash, nothing is run.
+	if (ex->words.count == 0)
+	{
+		word_list_add(&ex->words, "true", 4);
+	}
+	int count = ex->words.count;
+	ex->argv = malloc((count + 1) * sizeof(*ex->argv));
+	for (int i = 0; i < count; i++)
+	{
+		ex->argv[i] = ex->words.text.data + ex->words.offsets[i];
+	}
+	ex->argv[count] = NULL;
+	struct command *new_cmd = &ex->e.cmd;
+	new_cmd->argv = ex->argv;
+	new_cmd->exe = ex->argv[0];
+	new_cmd->args = ex->argv + 1;
+	new_cmd->arg_count = count - 1;
+	new_cmd->arg_capacity = count - 1;
+	new_cmd->substs = ex->substs;
+	new_cmd->expansions = NULL;
+	new_cmd->expansion_count = 0;
+	return &ex->e;
+}
+
+static void expanded_command_destroy(struct expanded_command *ex)
+{
+	word_list_destroy(&ex->words);
+	free(ex->argv);
+	free(ex->substs);
+}
+
+static int execute_list_of_expressions(const struct expr *e, struct command_line *line, struct shell *sh,
+				       int out_fd, bool *do_exit, struct line_stats *stats);
+
+// Opens the file the output of the line is redirected to. Returns stdout if
+// there is no redirect, -1 on error. Variables in the file name are expanded,
+// globs are not.
+static int open_line_output(struct shell *sh, const struct command_line *line)
+{
+	if (line->out_type == OUTPUT_TYPE_STDOUT)
+	{
+		return STDOUT_FILENO;
+	}
+	const char *file = line->out_file;
+	struct word_list words;
+	memset(&words, 0, sizeof(words));
+	if (line->out_file_source != NULL)
+	{
+		expand_word(sh, line->out_file_source, false, &words);
+		if (words.count != 1)
+		{
+			fprintf(stderr, "%s: ambiguous redirect\n", line->out_file_source);
+			word_list_destroy(&words);
+			return -1;
+		}
+		file = words.text.data;
+	}
+	int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+	if (line->out_type == OUTPUT_TYPE_FILE_NEW)
+	{
+		flags |= O_TRUNC;
+	}
+	else
+	{
+		flags |= O_APPEND;
+	}
+	int fd = open(file, flags, 0777);
+	if (fd == -1)
+	{
+		fprintf(stderr, "%s: %s\n", file, strerror(errno));
+	}
+	word_list_destroy(&words);
+	return fd;
+}
+
+// Starts the line in a child shell and returns its pid, for the lines which
+// run while the shell goes on. 'cd' and 'exit' there don't touch the shell.
+static pid_t start_line(struct shell *sh, struct command_line *line, int out_fd)
+{
+	pid_t pid = shell_fork(sh);
+	if (pid == -1)
+	{
+		printf("An error occurred with fork at command line execution\n");
+		exit(1);
+	}
+	if (pid == 0)
+	{
+		bool do_exit = false;
+		int status_code = execute_list_of_expressions(line->head, line, sh, out_fd, &do_exit, NULL);
+		command_line_delete(line);
+		shell_destroy(sh);
+		exit(status_code);
+	}
+	return pid;
+}
+
+// The line has builtins which read or change the state of the shell.
+static bool line_uses_shell(const struct command_line *line)
+{
+	for (const struct expr *e = line->head; e != NULL; e = e->next)
+	{
+		if (e->type != EXPR_TYPE_COMMAND)
+		{
+			continue;
+		}
+		const struct builtin *b = find_builtin(&e->cmd);
+		if (b != NULL && b->uses_shell)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// The command reads a here-document or outputs of process substitutions,
+// prepared by the shell before it is started.
+static bool command_has_inputs(const struct command *cmd)
+{
+	return cmd->heredoc != NULL || cmd->subst_count > 0;
+}
+
+// Runs the lines of '<(cmd)' and returns a memory file with their output.
+// The command gets it as /proc/self/fd/N, which is opened from the start.
+static int run_substitution(struct shell *sh, const char *text)
+{
+	int fd = memfd_create("process substitution", MFD_CLOEXEC);
+	if (fd == -1)
+	{
+		return -1;
+	}
+	// A parser of its own, the text can't leave anything in the main one.
+	struct parser *p = parser_new();
+	parser_feed(p, text, strlen(text));
+	parser_feed(p, "\n", 1);
+	struct command_line *line;
+	enum parser_error err;
+	while ((err = parser_pop_next(p, &line)) != PARSER_ERR_NONE || line != NULL)
+	{
+		if (err != PARSER_ERR_NONE)
+		{
+			fprintf(stderr, "Error: %d\n", (int)err);
+			continue;
+		}
+		int out_fd = line->out_type == OUTPUT_TYPE_STDOUT ? fd : open_line_output(sh, line);
+		if (out_fd != -1)
+		{
+			shell_hash_line(sh, line);
+			if (!line->is_background && !line_uses_shell(line))
+			{
+				bool do_exit = false;
+				execute_list_of_expressions(line->head, line, sh, out_fd, &do_exit, NULL);
+			}
+			else
+			{
+				// Like in a subshell, 'cd' there doesn't change the shell.
+				waitpid(start_line(sh, line, out_fd), NULL, 0);
+			}
+			if (out_fd != fd)
+			{
+				close(out_fd);
+			}
+		}
+		command_line_delete(line);
+	}
+	parser_delete(p);
+	return fd;
+}
+
+// Data for the command besides the pipes: fds[0] is the here-document, at
+// fds[1 + i] is the output of the i-th process substitution, -1 if it
+// failed. NULL if the command has none of them.
+static int *open_command_inputs(struct shell *sh, const struct command *cmd)
+{
+	if (!command_has_inputs(cmd))
+	{
+		return NULL;
+	}
+	int *fds = malloc((1 + cmd->subst_count) * sizeof(*fds));
+	fds[0] = -1;
+	if (cmd->heredoc != NULL)
+	{
+		fds[0] = memfd_create("here-document", MFD_CLOEXEC);
+		if (fds[0] != -1 && (write_all(fds[0], cmd->heredoc, cmd->heredoc_size) != 0
+				     || lseek(fds[0], 0, SEEK_SET) != 0))
+		{
+			close(fds[0]);
+			fds[0] = -1;
+		}
+	}
+	for (uint32_t i = 0; i < cmd->subst_count; i++)
+	{
+		fds[1 + i] = run_substitution(sh, cmd->argv[cmd->substs[i]]);
+	}
+	return fds;
+}
+
+static void close_command_inputs(const struct command *cmd, int *fds)
+{
+	if (fds == NULL)
+	{
+		return;
+	}
+	for (uint32_t i = 0; i < 1 + cmd->subst_count; i++)
+	{
+		if (fds[i] != -1)
+		{
+			close(fds[i]);
+		}
+	}
+	free(fds);
+}
+
+// In the started command: the here-document becomes stdin, and process
+// substitutions become paths to their outputs, written to paths. The line is
+// the child's own copy, so it can be changed.
+static void apply_command_inputs(struct command *cmd, const int *fds, char (*paths)[FD_PATH_SIZE])
+{
+	if (fds[0] != -1)
+	{
+		dup2(fds[0], STDIN_FILENO);
+	}
+	else if (cmd->heredoc != NULL)
+	{
+		int null_fd = open("/dev/null", O_RDONLY);
+		dup2(null_fd, STDIN_FILENO);
+		close(null_fd);
+	}
+	for (uint32_t i = 0; i < cmd->subst_count; i++)
+	{
+		int fd = fds[1 + i];
+		char *path = paths[i];
+		if (fd == -1)
+		{
+			strcpy(path, "/dev/null");
+		}
+		else
+		{
+			fcntl(fd, F_SETFD, 0);
+			snprintf(path, FD_PATH_SIZE, "/proc/self/fd/%d", fd);
+		}
+		cmd->argv[cmd->substs[i]] = path;
+	}
+	cmd->exe = cmd->argv[0];
+}
+
+// Starts a command of the line with the given stdin and stdout. Close_fd is
+// the shell's end of the next pipe, the child must not keep it. Returns the
+// pid.
+static pid_t start_command(struct shell *sh, struct command_line *line, const struct expr *e,
+			   int in_fd, int out_fd, int close_fd, const int *inputs, struct line_stats *stats)
+{
+	// The start latency is the time until the close-on-exec pipe is closed
+	// by exec, or by the child before a builtin.
+	int stats_i = -1;
+	int exec_fd[2] = {-1, -1};
+	if (stats != NULL)
+	{
+		stats_i = line_stats_add(stats, e->cmd.exe);
+		if (pipe2(exec_fd, O_CLOEXEC) == -1)
+		{
+			exec_fd[0] = exec_fd[1] = -1;
+		}
+	}
+	pid_t pid = shell_fork(sh);
+	if (pid == -1)
+	{
+		printf("An error occurred with the second fork for execution\n");
+		exit(1);
+	}
+	if (pid == 0)
+	{
+		if (exec_fd[0] != -1)
+		{
+			close(exec_fd[0]);
+			if (find_builtin(&e->cmd) != NULL)
+			{
+				close(exec_fd[1]);
+			}
+		}
+		if (stats != NULL)
+		{
+			free(stats->commands);
+		}
+		if (in_fd != STDIN_FILENO)
+		{
+			dup2(in_fd, STDIN_FILENO);
+			close(in_fd);
+		}
+		if (out_fd != STDOUT_FILENO)
+		{
+			dup2(out_fd, STDOUT_FILENO);
+			close(out_fd);
+		}
+		if (close_fd != -1)
+		{
+			close(close_fd);
+		}
+		// The paths are used until exec, or until the builtin exits.
+		char paths[inputs != NULL ? e->cmd.subst_count + 1 : 1][FD_PATH_SIZE];
+		if (inputs != NULL)
+		{
+			apply_command_inputs((struct command *)&e->cmd, inputs, paths);
+		}
+		execute_expression((struct expr *)e, line, sh);
+	}
+	if (stats_i != -1)
+	{
+		struct command_stats *cs = &stats->commands[stats_i];
+		cs->pid = pid;
+		if (exec_fd[0] != -1)
+		{
+			close(exec_fd[1]);
+			char c;
+			while (read(exec_fd[0], &c, 1) < 0 && errno == EINTR)
+				;
+			close(exec_fd[0]);
+			cs->start_latency = now() - cs->start;
+		}
 	}
+	return pid;
 }
 
-int get_exit_code(struct expr* e)
+// Waits for all the commands of a pipeline at once, they can finish in any
+// order. Returns the wait status of the last one.
+static int wait_pipeline(struct shell *sh, const pid_t *pids, int count, struct line_stats *stats)
 {
-	int exit_code = 0;
-	if (e->type == EXPR_TYPE_COMMAND)
+	int wstatus = 0;
+	int *pidfds = NULL;
+	int opened = 0;
+	if (count > 1)
 	{
-		if(!strcmp(e->cmd.exe, "exit")
-			&& e->cmd.arg_count == 1)
+		if (sh->epoll_fd == -1)
+		{
+			sh->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		}
+		pidfds = malloc(count * sizeof(*pidfds));
+		for (; opened < count && sh->epoll_fd != -1; opened++)
 		{
-			char* end;
-			exit_code = strtol(e->cmd.args[0], &end, 0);
+			pidfds[opened] = syscall(SYS_pidfd_open, pids[opened], 0);
+			if (pidfds[opened] == -1)
+			{
+				break;
+			}
+			struct epoll_event ev;
+			ev.events = EPOLLIN;
+			ev.data.u32 = opened;
+			if (epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, pidfds[opened], &ev) == -1)
+			{
+				close(pidfds[opened]);
+				break;
+			}
 		}
 	}
-	if(e)
+	if (opened < count)
 	{
-		e = e->next;
+		// No pidfds, like on old kernels. Wait in order.
+		for (int i = 0; i < opened; i++)
+		{
+			close(pidfds[i]);
+		}
+		for (int i = 0; i < count; i++)
+		{
+			wstatus = wait_command(pids[i], stats);
+		}
+		free(pidfds);
+		return wstatus;
 	}
-	return exit_code;
+	struct epoll_event events[16];
+	for (int left = count; left > 0;)
+	{
+		int n = epoll_wait(sh->epoll_fd, events, 16, -1);
+		for (int i = 0; i < n; i++)
+		{
+			int stage = events[i].data.u32;
+			// Closing the pidfd removes it from the epoll set.
+			close(pidfds[stage]);
+			int rc = wait_command(pids[stage], stats);
+			if (stage == count - 1)
+			{
+				wstatus = rc;
+			}
+			left--;
+		}
+	}
+	free(pidfds);
+	return wstatus;
 }
 
-// This function handles the execution of expressions and their connections by
-// 1) Redirecting stdout to a pipe if we have | after an expression (in child process)
-// 2) Save the input pipe associated with the prior fd
-// 3) Redirecting stdin to that pipe in the following expression
-// 4) Consecutive pipes are handled by using different FDs
-// 5) Handling ||, and && by keeping track of the exit code of the prior process.
-static char* execute_list_of_expressions(const struct expr *e, struct command_line *line, struct parser *p, int* exit_code) {
-	int status_code = -1;
-	*exit_code = 0;
-	char* final_directory = NULL;
-	int stdout_fd = -1, stdin_fd = -1, tmp_stdin_fd;
-	int fd[2];
-	int n_non_checked_processes = 0;
-	int* non_checked_processes = NULL;
-
-	// Get parameters:
+// This function executes the expressions of a line right in the shell
+// process, without a subshell:
+// 1) Commands joined by | are started at once, connected with pipes, and
+//    waited for together. The status of the pipeline is the last command's.
+// 2) && and || skip the next pipeline depending on the status of the prior
+//    one.
+// 3) Builtins which are not part of a pipe are run here without a fork, so
+//    'cd' and 'exit' change the shell itself.
+// 4) Commands write to out_fd unless their output goes to a pipe.
+// 5) The commands are accounted if stats is not NULL.
+// Sets do_exit if 'exit' was run, the status is its exit code then.
+static int execute_list_of_expressions(const struct expr *e, struct command_line *line, struct shell *sh,
+				       int out_fd, bool *do_exit, struct line_stats *stats)
+{
+	int status_code = 0;
 	while (e != NULL)
 	{
-		// redirect output to pipe
-		if(e->next && e->next->type == EXPR_TYPE_PIPE) {
-			if (pipe(fd) == -1){
-				printf("An error occurred while opening the pipe\n");
+		if (e->type == EXPR_TYPE_AND || e->type == EXPR_TYPE_OR)
+		{
+			// If the last pipeline failed for &&, or succeeded for ||,
+			// skip the next one.
+			bool skip = (e->type == EXPR_TYPE_AND) == (status_code != 0);
+			e = e->next;
+			while (skip && e != NULL && e->type != EXPR_TYPE_AND && e->type != EXPR_TYPE_OR)
+			{
+				e = e->next;
 			}
-			stdout_fd = dup(fd[1]);
-			tmp_stdin_fd = dup(fd[0]);
-			close(fd[0]);
-			close(fd[1]);
+			continue;
+		}
+		assert(e->type == EXPR_TYPE_COMMAND);
+		int stage_count = 1;
+		for (const struct expr *i = e->next; i != NULL && i->type == EXPR_TYPE_PIPE; i = i->next->next)
+		{
+			stage_count++;
 		}
 
-		if (e->type == EXPR_TYPE_COMMAND)
+		struct expanded_command ex;
+		const struct expr *stage = expand_command(sh, e, &ex);
+		const struct builtin *b = NULL;
+		if (stage_count == 1 && !command_has_inputs(&stage->cmd))
+		{
+			b = find_builtin(&stage->cmd);
+		}
+		if (b != NULL)
 		{
-			int pid2 = fork();
-			if (pid2 == -1) {
-				printf("An error occurred with the second fork for execution\n");
-				exit(1);
+			int stats_i = stats != NULL ? line_stats_add(stats, stage->cmd.exe) : -1;
+			status_code = b->run(sh, &stage->cmd, out_fd);
+			sh->last_status = status_code;
+			expanded_command_destroy(&ex);
+			if (stats_i != -1)
+			{
+				struct command_stats *cs = &stats->commands[stats_i];
+				cs->wall = now() - cs->start;
 			}
-			if(pid2 == 0) {
-				if(stdin_fd != -1){
-					dup2(stdin_fd, STDIN_FILENO);
-					close(stdin_fd);
-				}
-				if(stdout_fd != -1) {
-					close(tmp_stdin_fd);
-					dup2(stdout_fd, STDOUT_FILENO);
-					close(stdout_fd);
-				}
-				if(non_checked_processes)
-				{
-					free(non_checked_processes);
-				}
-				execute_expression((struct expr*)e, line, p);
+			if (b->run == builtin_exit)
+			{
+				*do_exit = true;
+				break;
 			}
-			else {
-				// if next is pipe, don't wait and start next process, else, wait
-				if(e->next && e->next->type == EXPR_TYPE_PIPE)
+			e = e->next;
+			continue;
+		}
+
+		pid_t *pids = malloc(stage_count * sizeof(*pids));
+		int in_fd = STDIN_FILENO;
+		for (int i = 0; i < stage_count; i++)
+		{
+			int stage_out_fd = out_fd;
+			int fd[2] = {-1, -1};
+			if (i < stage_count - 1)
+			{
+				if (pipe2(fd, O_CLOEXEC) == -1)
 				{
-					if(!strcmp(e->cmd.exe, "cd") && e->cmd.arg_count == 1) {
-						chdir(e->cmd.args[0]);
-						final_directory = e->cmd.args[0];
-					}
-					n_non_checked_processes ++;
-					non_checked_processes = realloc(non_checked_processes, n_non_checked_processes * sizeof(int));
-					non_checked_processes[n_non_checked_processes-1] = pid2;
+					printf("An error occurred while opening the pipe\n");
+					fd[0] = open("/dev/null", O_RDONLY | O_CLOEXEC);
 				}
 				else
 				{
-					waitpid(pid2, &status_code, 0);
-					status_code = WEXITSTATUS(status_code);
-					// Handle CD exception
-					if(status_code == CD_CODE && e->cmd.arg_count == 1)
+					if (stage_count <= PIPE_RESIZE_MAX_STAGES)
 					{
-						chdir(e->cmd.args[0]);
-						final_directory = e->cmd.args[0];
-					}
-					else
-					{
-						*exit_code = get_exit_code((struct expr*)e);
-						if(!(*exit_code))
-						{
-							*exit_code = status_code;
-						}
+						// Can fail because of the limits, the default size works too.
+						fcntl(fd[1], F_SETPIPE_SZ, PIPE_BUFFER_SIZE);
 					}
-				}
-				if(stdin_fd != -1){
-					close(stdin_fd);
-					stdin_fd = -1;
+					stage_out_fd = fd[1];
 				}
 			}
-		}
-		else if (e->type == EXPR_TYPE_PIPE)
-		{
-			close(stdout_fd);
-			stdout_fd = -1;
-			stdin_fd = tmp_stdin_fd;
-		}
-		else if (e->type == EXPR_TYPE_AND)
-		{
-			// If last command wasn't a success, skip next.
-			if(status_code != 0 && status_code != CD_CODE){
-				e = e->next;
+			if (i > 0)
+			{
+				stage = expand_command(sh, e, &ex);
 			}
-		}
-		else if (e->type == EXPR_TYPE_OR)
-		{
-			// If last one didn't fail, skip next command.
-			if(status_code == 0 || status_code == CD_CODE) {
-				e = e->next;
+			int *inputs = open_command_inputs(sh, &stage->cmd);
+			pids[i] = start_command(sh, line, stage, in_fd, stage_out_fd, fd[0], inputs, stats);
+			close_command_inputs(&stage->cmd, inputs);
+			expanded_command_destroy(&ex);
+			if (in_fd != STDIN_FILENO)
+			{
+				close(in_fd);
 			}
-		}
-		else
-		{
-			assert(false);
-		}
-		if(e)
-		{
+			if (fd[1] != -1)
+			{
+				close(fd[1]);
+			}
+			in_fd = fd[0];
 			e = e->next;
+			if (i < stage_count - 1)
+			{
+				// Skip the pipe.
+				e = e->next;
+			}
 		}
+		status_code = wait_status_to_exit_code(wait_pipeline(sh, pids, stage_count, stats));
+		sh->last_status = status_code;
+		free(pids);
 	}
-	while(n_non_checked_processes--)
+	return status_code;
+}
+
+// A line consisting only of builtins joined by && and || can be run by the
+// shell itself, without any forks.
+static bool is_builtin_only_line(const struct command_line *line)
+{
+	if (line->is_background)
 	{
-		waitpid(non_checked_processes[n_non_checked_processes], NULL, 0);
+		return false;
 	}
-	if(non_checked_processes)
+	for (const struct expr *e = line->head; e != NULL; e = e->next)
 	{
-		free(non_checked_processes);
+		if (e->type == EXPR_TYPE_PIPE)
+		{
+			return false;
+		}
+		if (e->type == EXPR_TYPE_COMMAND && find_builtin(&e->cmd) == NULL)
+		{
+			return false;
+		}
 	}
-	return final_directory;
+	return true;
+}
+
+static void print_time(const char *name, double seconds)
+{
+	int minutes = (int)(seconds / 60);
+	fprintf(stderr, "%s\t%dm%.3fs\n", name, minutes, seconds - minutes * 60);
+}
+
+// User and sys time of the shell and of its waited children, in seconds.
+static void get_cpu_times(double *user, double *sys)
+{
+	struct rusage self, children;
+	getrusage(RUSAGE_SELF, &self);
+	getrusage(RUSAGE_CHILDREN, &children);
+	*user = timeval_seconds(&self.ru_utime) + timeval_seconds(&children.ru_utime);
+	*sys = timeval_seconds(&self.ru_stime) + timeval_seconds(&children.ru_stime);
+}
+
+static void print_times(double real, double user, double sys)
+{
+	fprintf(stderr, "\n");
+	print_time("real", real);
+	print_time("user", user);
+	print_time("sys", sys);
 }
 
 // This function handles the external effects of a command line
-// 1) Redirecting ouput to a file if necessary
-// 2) If process is not a background process, 
-// 	  it waits for it and processes its exit code.
-// 2) Exits code if it gets a special exit code.
-// 3) Changing directory (by using pipes between child and parent).
-// 4) Redirecting output back to STDOUT
+// 1) Opening the file the output is redirected to, if necessary. The shell's
+// 	  own stdout is never changed, the file goes to the commands.
+// 2) If process is not a background process, the shell runs it right away
+// 	  and takes its exit code. Otherwise it is started in a child and added
+// 	  to the job table.
+// 3) Exits code if the line asks to.
+// 4) Printing the time of the line with 'time', and accounting the
+// 	  commands for the profile.
 static int
-execute_command_line(struct command_line *line, struct parser *p, int* exit_code)
+execute_command_line(struct command_line *line, struct shell *sh, int* exit_code)
 {
 	assert(line != NULL);
-	if(line->head == line->tail 
-		&& line->head->type == EXPR_TYPE_COMMAND
-		&& !strcmp(line->head->cmd.exe, "exit")
-		&& line->head->cmd.arg_count <= 1)
-	{
-		return EXIT_CODE;
-	}
-	// Redirect output path to a file if necessary.
-	int original_stdout;
-	if (line->out_type == OUTPUT_TYPE_FILE_NEW)
+	// The lines before are done, parallel ones too.
+	sh->last_status = *exit_code;
+	int out_fd = open_line_output(sh, line);
+	if (out_fd == -1)
 	{
-		int file = open(line->out_file, O_WRONLY | O_CREAT |  O_TRUNC, 0777);
-		original_stdout = dup(STDOUT_FILENO);
-		dup2(file, STDOUT_FILENO);
-		close(file);
+		*exit_code = 1;
+		return 0;
 	}
-	else if (line->out_type == OUTPUT_TYPE_FILE_APPEND)
+	shell_hash_line(sh, line);
+
+	if (line->is_background)
 	{
-		int file = open(line->out_file, O_WRONLY | O_CREAT| O_APPEND, 0777);
-		original_stdout = dup(STDOUT_FILENO);
-		dup2(file, STDOUT_FILENO);
-		close(file);
+		// Keep the number of processes bounded.
+		while (sh->running_job_count >= JOBS_MAX_RUNNING)
+		{
+			shell_reap_jobs(sh, true);
+		}
+		// 'time' is ignored for background lines.
+		shell_add_job(sh, start_line(sh, line, out_fd), line);
+		if (out_fd != STDOUT_FILENO)
+		{
+			close(out_fd);
+		}
+		return 0;
 	}
 
-	// Create pipe for cd path info 
-	int fd[2];
-	bool fd_open = true;
-	if (pipe(fd) == -1){
-		printf("An error occurred while opening the pipe\n");
-		fd_open = false;
+	double start = now();
+	double user_start = 0, sys_start = 0;
+	if (line->is_timed)
+	{
+		get_cpu_times(&user_start, &sys_start);
 	}
-
-	// Create child process to execute list of expressions
-	int pid = fork();
-	if (pid == -1)
+	struct line_stats stats = {NULL, 0, 0};
+	bool do_exit = false;
+	*exit_code = execute_list_of_expressions(line->head, line, sh, out_fd, &do_exit,
+						 sh->profile != NULL ? &stats : NULL);
+	if (*exit_code == EXIT_CODE_NOT_FOUND)
 	{
-		printf("An error occurred with fork at command line execution\n");
-		exit(1);
+		shell_unhash_line(sh, line);
 	}
-
-	// child process
-	if (pid == 0)
+	for (int i = 0; i < stats.count; i++)
 	{
-		char* final_directory = execute_list_of_expressions(line->head, line, p, exit_code);
-		close(fd[0]);
-		if(final_directory && fd_open){
-			int size = (int)strlen(final_directory);
-			write(fd[1], &size, sizeof(int));
-			write(fd[1], final_directory, size);
-			command_line_delete(line);
-			parser_delete(p);
-			exit(CD_CODE);
-		}
-		close(fd[1]);
-		command_line_delete(line);
-		parser_delete(p);
-		free(final_directory);
-		close(fd[1]);
-		// Should be fine..
-		exit(*exit_code);
+		profile_add(sh->profile, &stats.commands[i]);
 	}
-	// Parent process.
-	else
+	free(stats.commands);
+	if (line->is_timed)
 	{
-		// Check if process should be in background or not, if not, wait for it to execute.
-		if (!line->is_background)
-		{
-			int wstatus;
-			wait(&wstatus);
-			if (WIFEXITED(wstatus))
-			{
-				int status_code = WEXITSTATUS(wstatus);
-				
-				close(fd[1]);
-				char* final_directory = NULL;
-				int size;
-				if(fd_open && status_code == CD_CODE){
-					if(read(fd[0], &size, sizeof(int))) {
-						final_directory = malloc(size +1);
-					}
-					if(read(fd[0], final_directory, size)) {
-						*(final_directory + size) = '\0';
-						chdir(final_directory);
-					}
-					free(final_directory);
-				}
-				else
-				{
-					*exit_code = status_code;
-				}
-				close(fd[0]);
-			}
-		}
-		else
-		{
-			return 1;
-		}
+		double user, sys;
+		get_cpu_times(&user, &sys);
+		print_times(now() - start, user - user_start, sys - sys_start);
 	}
-	// close the output path to a file if necessary.
-	if (line->out_type != OUTPUT_TYPE_STDOUT)
+	if (out_fd != STDOUT_FILENO)
 	{
-		dup2(original_stdout, STDOUT_FILENO);
+		close(out_fd);
 	}
-	return 0;
+	return do_exit ? EXIT_CODE : 0;
 }
 
 // Utility function to print command line, uncomment for use.
@@ -344,49 +2546,349 @@ execute_command_line(struct command_line *line, struct parser *p, int* exit_code
 // 	}
 // }
 
-int main(void)
+// Expanded words can be anything, like the files written by the running
+// lines, and $? needs the lines before to be done.
+static bool line_has_expansions(const struct command_line *line)
 {
-	const size_t buf_size = 1024;
-	char buf[buf_size];
-	int rc;
-	struct parser *p = parser_new();
-	int exit = 0, exit_code = 0;
-	int n_background_lines = 0;
-	while ((rc = read(STDIN_FILENO, buf, buf_size)) > 0) {
-		parser_feed(p, buf, rc);
-		struct command_line *line = NULL;
-		while (true) {
-			enum parser_error err = parser_pop_next(p, &line);
-			if (err == PARSER_ERR_NONE && line == NULL)
-				break;
-			if (err != PARSER_ERR_NONE) {
-				printf("Error: %d\n", (int)err);
+	if (line->out_file_source != NULL)
+	{
+		return true;
+	}
+	for (const struct expr *e = line->head; e != NULL; e = e->next)
+	{
+		if (e->type == EXPR_TYPE_COMMAND && e->cmd.expansion_count > 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// A line can run at once with others if it is in foreground and doesn't
+// touch the shell state, like 'cd' does. Lines using the files written by the
+// running lines wait for them. Other data the commands share, like files
+// written by the programs themselves, is not seen by the shell, -j is opt-in.
+static bool can_run_in_parallel(const struct command_line *line)
+{
+	return !line->is_background && !line->is_timed && !line_uses_shell(line)
+		&& !line_has_expansions(line);
+}
+
+static bool shell_is_parallel_output(const struct shell *sh, const char *file)
+{
+	for (int i = 0; i < sh->parallel_line_count; i++)
+	{
+		const struct command_line *line = sh->parallel_lines[i].line;
+		if (line->out_type != OUTPUT_TYPE_STDOUT && !strcmp(line->out_file, file))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// Whether the file is an argument of a running line, so it may be read.
+static bool shell_is_parallel_input(const struct shell *sh, const char *file)
+{
+	for (int i = 0; i < sh->parallel_line_count; i++)
+	{
+		for (const struct expr *e = sh->parallel_lines[i].line->head; e != NULL; e = e->next)
+		{
+			if (e->type != EXPR_TYPE_COMMAND)
+			{
 				continue;
 			}
-			int status = execute_command_line(line, p, &exit_code);
-			if(status == EXIT_CODE)
+			for (uint32_t j = 0; j < e->cmd.arg_count; j++)
 			{
-				exit = 1;
-				exit_code = 0;
-				if(line->head->cmd.arg_count == 1)
+				if (!strcmp(e->cmd.args[j], file))
 				{
-					exit_code = atoi(line->head->cmd.args[0]);
+					return true;
 				}
-				command_line_delete(line);
-				break;
 			}
-			n_background_lines += status;
+		}
+	}
+	return false;
+}
+
+// The line writes to the same file as one of the running lines, or has it
+// among the arguments, like 'cat file' after 'echo 1 > file'.
+static bool shell_depends_on_parallel_lines(const struct shell *sh, const struct command_line *line)
+{
+	// The output is truncated when the line starts, so the lines reading or
+	// writing the file finish first.
+	if (line->out_type != OUTPUT_TYPE_STDOUT && (shell_is_parallel_output(sh, line->out_file)
+		|| shell_is_parallel_input(sh, line->out_file)))
+	{
+		return true;
+	}
+	for (const struct expr *e = line->head; e != NULL; e = e->next)
+	{
+		if (e->type != EXPR_TYPE_COMMAND)
+		{
+			continue;
+		}
+		for (uint32_t i = 0; i < e->cmd.arg_count; i++)
+		{
+			if (shell_is_parallel_output(sh, e->cmd.args[i]))
+			{
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// Waits for the oldest started line and prints its output.
+static void shell_commit_parallel_line(struct shell *sh, int *exit_code)
+{
+	struct parallel_line *pl = &sh->parallel_lines[0];
+	if (!pl->is_finished)
+	{
+		int wstatus;
+		if (waitpid(pl->pid, &wstatus, 0) == pl->pid)
+		{
+			pl->status = wait_status_to_exit_code(wstatus);
+		}
+	}
+	if (pl->out_fd != -1)
+	{
+		lseek(pl->out_fd, 0, SEEK_SET);
+		copy_fd(pl->out_fd, STDOUT_FILENO);
+		close(pl->out_fd);
+	}
+	*exit_code = pl->status;
+	if (pl->status == EXIT_CODE_NOT_FOUND)
+	{
+		shell_unhash_line(sh, pl->line);
+	}
+	command_line_delete(pl->line);
+	sh->parallel_line_count--;
+	memmove(pl, pl + 1, sh->parallel_line_count * sizeof(*pl));
+}
+
+static void shell_commit_parallel_lines(struct shell *sh, int *exit_code)
+{
+	while (sh->parallel_line_count > 0)
+	{
+		shell_commit_parallel_line(sh, exit_code);
+	}
+}
+
+// Starts the line without waiting for it. Returns false if it can't be done
+// and the line has to be executed as usual.
+static bool shell_start_parallel_line(struct shell *sh, struct command_line *line, int *exit_code)
+{
+	if (shell_depends_on_parallel_lines(sh, line))
+	{
+		shell_commit_parallel_lines(sh, exit_code);
+	}
+	else if (sh->parallel_line_count == sh->max_parallel_lines)
+	{
+		shell_commit_parallel_line(sh, exit_code);
+	}
+	int mem_fd = -1;
+	int out_fd = STDOUT_FILENO;
+	if (line->out_type == OUTPUT_TYPE_STDOUT)
+	{
+		mem_fd = memfd_create("line output", MFD_CLOEXEC);
+		if (mem_fd == -1)
+		{
+			return false;
+		}
+		out_fd = mem_fd;
+	}
+	else
+	{
+		// Lines are started in order, so the file is created and truncated
+		// when the lines before have stopped writing into it.
+		out_fd = open_line_output(sh, line);
+		if (out_fd == -1)
+		{
 			command_line_delete(line);
+			*exit_code = 1;
+			return true;
+		}
+	}
+	struct parallel_line *pl = &sh->parallel_lines[sh->parallel_line_count];
+	pl->line = line;
+	pl->out_fd = mem_fd;
+	pl->pid = 0;
+	pl->is_finished = true;
+	pl->status = 0;
+	if (is_builtin_only_line(line))
+	{
+		// Cheaper to run right away than to fork.
+		bool do_exit = false;
+		pl->status = execute_list_of_expressions(line->head, line, sh, out_fd, &do_exit, NULL);
+	}
+	else
+	{
+		shell_hash_line(sh, line);
+		pl->pid = start_line(sh, line, out_fd);
+		pl->is_finished = false;
+	}
+	if (out_fd != mem_fd)
+	{
+		close(out_fd);
+	}
+	sh->parallel_line_count++;
+	return true;
+}
+
+// Executes all the complete lines the parser has. Returns EXIT_CODE when the
+// shell has to terminate.
+static int execute_parsed_lines(struct shell *sh, int *exit_code)
+{
+	struct command_line *line = NULL;
+	while (true) {
+		enum parser_error err = parser_pop_next(sh->p, &line);
+		if (err == PARSER_ERR_NONE && line == NULL)
+		{
+			shell_commit_parallel_lines(sh, exit_code);
+			return 0;
 		}
-		if(exit)
+		if (err != PARSER_ERR_NONE) {
+			shell_commit_parallel_lines(sh, exit_code);
+			printf("Error: %d\n", (int)err);
+			continue;
+		}
+		shell_reap_jobs(sh, false);
+		if (sh->profile != NULL)
 		{
-			break;
+			sh->profile->line_count++;
+		}
+		if (sh->max_parallel_lines > 1 && can_run_in_parallel(line)
+			&& shell_start_parallel_line(sh, line, exit_code))
+		{
+			continue;
+		}
+		shell_commit_parallel_lines(sh, exit_code);
+		int status = execute_command_line(line, sh, exit_code);
+		command_line_delete(line);
+		if(status == EXIT_CODE)
+		{
+			return EXIT_CODE;
 		}
 	}
-	while(n_background_lines --)
+}
+
+// Script mode for regular files: the script is mapped into memory and fed to
+// the parser in big windows, so there is no read() per KB of input. The file
+// offset is kept in sync with the fed data, as if it was read(), so commands
+// reading the shell's stdin see the same data as before.
+static int execute_mapped_script(int fd, size_t size, struct shell *sh, int *exit_code)
+{
+	char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
 	{
-		waitpid(-1, NULL, 0);
+		return -1;
+	}
+	madvise(data, size, MADV_SEQUENTIAL);
+	int rc = 0;
+	for (size_t offset = 0; offset < size && rc != EXIT_CODE;)
+	{
+		size_t len = size - offset;
+		if (len > SCRIPT_WINDOW_SIZE)
+		{
+			len = SCRIPT_WINDOW_SIZE;
+		}
+		parser_feed(sh->p, data + offset, len);
+		offset += len;
+		lseek(fd, offset, SEEK_SET);
+		rc = execute_parsed_lines(sh, exit_code);
+	}
+	munmap(data, size);
+	return rc;
+}
+
+// Usage: ./a.out [-j N] [-p profile.json] [script]
+// With -j, up to N independent lines of the script run at once. With -p, the
+// time and resources used by the commands are written to the file on exit.
+int main(int argc, char **argv)
+{
+	int max_parallel_lines = 1;
+	const char *profile_path = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "j:p:")) != -1)
+	{
+		if (opt == 'j')
+		{
+			max_parallel_lines = atoi(optarg);
+		}
+		else if (opt == 'p')
+		{
+			profile_path = optarg;
+		}
+		if (opt == '?' || max_parallel_lines < 1 || max_parallel_lines > PARALLEL_LINES_MAX)
+		{
+			fprintf(stderr, "Usage: %s [-j 1..%d] [-p profile.json] [script]\n", argv[0], PARALLEL_LINES_MAX);
+			return 2;
+		}
+	}
+	int profile_fd = -1;
+	if (profile_path != NULL)
+	{
+		profile_fd = open(profile_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (profile_fd == -1)
+		{
+			fprintf(stderr, "%s: %s\n", profile_path, strerror(errno));
+			return 1;
+		}
+	}
+	int in_fd = STDIN_FILENO;
+	if (optind < argc)
+	{
+		in_fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+		if (in_fd == -1)
+		{
+			fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+			return 127;
+		}
+	}
+	struct shell sh;
+	shell_create(&sh);
+	sh.max_parallel_lines = max_parallel_lines;
+	sh.parallel_lines = malloc(max_parallel_lines * sizeof(*sh.parallel_lines));
+	if (profile_fd != -1)
+	{
+		sh.profile = calloc(1, sizeof(*sh.profile));
+		sh.profile->fd = profile_fd;
+		sh.profile->start = now();
+	}
+	int exit_code = 0;
+	int rc = -1;
+	struct stat st;
+	if (fstat(in_fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+	{
+		rc = execute_mapped_script(in_fd, st.st_size, &sh, &exit_code);
+	}
+	if (rc == -1)
+	{
+		char *buf = malloc(SCRIPT_BLOCK_SIZE);
+		ssize_t size;
+		while ((size = read(in_fd, buf, SCRIPT_BLOCK_SIZE)) > 0) {
+			parser_feed(sh.p, buf, size);
+			if (execute_parsed_lines(&sh, &exit_code) == EXIT_CODE)
+			{
+				break;
+			}
+		}
+		free(buf);
+	}
+	while (sh.running_job_count > 0)
+	{
+		shell_reap_jobs(&sh, true);
+	}
+	if (sh.profile != NULL)
+	{
+		struct parser_stats parser_stats;
+		parser_get_stats(sh.p, &parser_stats);
+		profile_write(sh.profile, &parser_stats, &sh.dirs);
+	}
+	shell_destroy(&sh);
+	if (in_fd != STDIN_FILENO)
+	{
+		close(in_fd);
 	}
-	parser_delete(p);
 	return exit_code;
 }
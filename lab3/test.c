@@ -1,8 +1,13 @@
 #include "userfs.h"
 #include "../utils/unit.h"
 #include <assert.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 static void
 test_open(void)
@@ -306,6 +311,49 @@ test_max_file_size(void)
 	unit_test_finish();
 }
 
+static void
+test_extent_borders(void)
+{
+	unit_test_start();
+	/*
+	 * Parts of odd sizes cross the borders of the storage units at
+	 * different offsets, whatever their sizes are.
+	 */
+	int size = 3 * 1024 * 1024 + 12345;
+	char *buf = malloc(size);
+	char *buf2 = malloc(size);
+	for (int i = 0; i < size; ++i)
+		buf[i] = i * 7 + i / 4096;
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	int progress = 0;
+	for (int part = 1; progress < size; part = part * 3 % 100003) {
+		if (part > size - progress)
+			part = size - progress;
+		unit_fail_if(ufs_write(fd, buf + progress, part) != part);
+		progress += part;
+	}
+	int fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	progress = 0;
+	for (int part = 5; progress < size; part = part * 7 % 65537) {
+		ssize_t rc = ufs_read(fd2, buf2 + progress, part);
+		if (rc <= 0)
+			break;
+		progress += rc;
+	}
+	unit_check(progress == size && ufs_read(fd2, buf2, 1) == 0,
+		   "read all");
+	unit_check(memcmp(buf, buf2, size) == 0, "data is correct");
+	free(buf2);
+	free(buf);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
 static void
 test_rights(void)
 {
@@ -441,6 +489,508 @@ test_resize(void)
 #endif
 }
 
+static void
+test_resize_grow(void)
+{
+#ifdef NEED_RESIZE
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char buffer[2048];
+	memset(buffer, 'a', sizeof(buffer));
+	unit_fail_if(ufs_write(fd, buffer, sizeof(buffer)) != sizeof(buffer));
+	unit_fail_if(ufs_resize(fd, 700) != 0);
+	unit_check(ufs_resize(fd, 1500) == 0, "grow after shrink");
+	int fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	unit_check(ufs_read(fd2, buffer, sizeof(buffer)) == 1500,
+		   "the size is the new one");
+	bool ok = true;
+	for (int i = 0; i < 1500 && ok; ++i)
+		ok = buffer[i] == (i < 700 ? 'a' : 0);
+	unit_check(ok, "the data is kept, the new part is zeros");
+	unit_check(ufs_resize(fd, 1024 * 1024 * 100 + 1) == -1,
+		   "can not grow over max file size");
+	unit_check(ufs_errno() == UFS_ERR_NO_MEM, "errno is set");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_positional(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_pwrite(fd, "world", 5, 6) == 5, "pwrite past the end");
+	unit_check(ufs_pwrite(fd, "hello", 5, 0) == 5, "pwrite at the start");
+	char buf[32];
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 0) == 11, "pread all");
+	unit_check(memcmp(buf, "hello\0world", 11) == 0, "the gap is zeros");
+	unit_check(ufs_pread(fd, buf, 3, 7) == 3 && memcmp(buf, "orl", 3) == 0,
+		   "pread in the middle");
+	unit_check(ufs_pread(fd, buf, 3, 11) == 0, "pread at the end");
+	unit_check(ufs_pread(fd, buf, 3, 100) == 0, "pread past the end");
+	unit_check(ufs_read(fd, buf, 5) == 5 && memcmp(buf, "hello", 5) == 0,
+		   "the position is not moved by pread and pwrite");
+
+	unit_check(ufs_seek(fd, 1, UFS_SEEK_CUR) == 6, "seek from the position");
+	unit_check(ufs_read(fd, buf, 5) == 5 && memcmp(buf, "world", 5) == 0,
+		   "read after seek");
+	unit_check(ufs_seek(fd, -5, UFS_SEEK_END) == 6, "seek from the end");
+	unit_check(ufs_seek(fd, 2, UFS_SEEK_SET) == 2, "seek from the start");
+	unit_check(ufs_read(fd, buf, 3) == 3 && memcmp(buf, "llo", 3) == 0,
+		   "read after seek from the start");
+	unit_check(ufs_seek(fd, 4, UFS_SEEK_END) == 15, "seek past the end");
+	unit_check(ufs_read(fd, buf, 1) == 0, "read past the end");
+	unit_check(ufs_write(fd, "!", 1) == 1, "write past the end");
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 0) == 16 &&
+		   memcmp(buf + 11, "\0\0\0\0!", 5) == 0, "the gap is zeros");
+
+	unit_check(ufs_seek(fd, -1, UFS_SEEK_SET) == -1, "negative position");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARGUMENT, "errno is set");
+	unit_check(ufs_seek(fd, 1024 * 1024 * 100 + 1, UFS_SEEK_SET) == -1,
+		   "position over max file size");
+	unit_check(ufs_seek(fd, 0, 100) == -1, "bad whence");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARGUMENT, "errno is set");
+	unit_check(ufs_pread(fd + 1, buf, 1, 0) == -1, "pread bad descriptor");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+	unit_check(ufs_seek(fd + 1, 0, UFS_SEEK_SET) == -1, "seek bad descriptor");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_vectors(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	struct iovec out[] = {
+		{(char *)"head", 4}, {NULL, 0}, {(char *)"payload", 7},
+	};
+	unit_check(ufs_writev(fd, out, 3) == 11, "writev");
+	unit_check(ufs_writev(fd, out, 0) == 0, "writev of nothing");
+	unit_check(ufs_writev(fd, out, -1) == -1, "writev negative count");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARGUMENT, "errno is set");
+	unit_fail_if(ufs_seek(fd, 0, UFS_SEEK_SET) != 0);
+	char a[3], b[5], c[16];
+	struct iovec in[] = {{a, 3}, {b, 5}, {c, 16}};
+	unit_check(ufs_readv(fd, in, 3) == 11, "readv");
+	unit_check(memcmp(a, "hea", 3) == 0 && memcmp(b, "dpayl", 5) == 0 &&
+		   memcmp(c, "oad", 3) == 0, "readv fills one after another");
+	unit_check(ufs_readv(fd, in, 3) == 0, "readv at the end");
+
+	/* The views are split where the file memory is. */
+	int size = 10000;
+	char *buf = malloc(size);
+	for (int i = 0; i < size; ++i)
+		buf[i] = i % 113;
+	unit_fail_if(ufs_pwrite(fd, buf, size, 0) != size);
+	unit_fail_if(ufs_seek(fd, 100, UFS_SEEK_SET) != 100);
+	struct ufs_view views[8];
+	int count = ufs_read_view(fd, views, 8, size);
+	unit_check(count > 0, "read view");
+	int progress = 100;
+	bool ok = true;
+	for (int i = 0; i < count && ok; ++i) {
+		ok = memcmp(views[i].data, buf + progress, views[i].size) == 0;
+		progress += views[i].size;
+	}
+	unit_check(ok && progress == size, "views cover the rest of the file");
+	unit_check(ufs_read_view(fd, views, 8, size) == 0, "read view at the end");
+	unit_fail_if(ufs_seek(fd, 0, UFS_SEEK_SET) != 0);
+	unit_check(ufs_read_view(fd, views, 1, 7) == 1 && views[0].size == 7,
+		   "read view is limited by size");
+	unit_check(ufs_read(fd, c, 1) == 1 && c[0] == buf[7],
+		   "read view moves the position");
+	unit_check(ufs_read_view(fd, views, 0, 7) == 0, "read no views");
+	free(buf);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_reuse(void)
+{
+	unit_test_start();
+
+	/* Memory of a deleted file is reused, but not its data. */
+	int size = 3 * 1024 * 1024;
+	char *buf = malloc(size);
+	memset(buf, 'x', size);
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, buf, size) != size);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_pwrite(fd, "y", 1, size - 1) != 1);
+	unit_check(ufs_read(fd, buf, size) == size, "read all");
+	bool ok = buf[size - 1] == 'y';
+	for (int i = 0; i < size - 1 && ok; ++i)
+		ok = buf[i] == 0;
+	unit_check(ok, "the new file is zeros");
+	free(buf);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+enum {
+	THREAD_COUNT = 8,
+	THREAD_FILE_SIZE = 1024 * 1024,
+	THREAD_OP_SIZE = 4096 + 123,
+};
+
+static char thread_shared_data[THREAD_FILE_SIZE];
+
+struct thread_ctx {
+	int id;
+	int shared_fd;
+	bool ok;
+	enum ufs_error_code error;
+};
+
+static void *
+thread_worker(void *arg)
+{
+	struct thread_ctx *ctx = arg;
+	char name[16];
+	sprintf(name, "file%d", ctx->id);
+	int fd = ufs_open(name, UFS_CREATE);
+	ctx->ok = fd != -1;
+	char *buf = malloc(THREAD_FILE_SIZE);
+	char *buf2 = malloc(THREAD_FILE_SIZE);
+	for (int i = 0; i < THREAD_FILE_SIZE; ++i)
+		buf[i] = i * (ctx->id + 1);
+	/* Own file by parts, while the others do the same. */
+	for (int pos = 0; pos < THREAD_FILE_SIZE && ctx->ok;
+	     pos += THREAD_OP_SIZE) {
+		int part = THREAD_FILE_SIZE - pos < THREAD_OP_SIZE ?
+			   THREAD_FILE_SIZE - pos : THREAD_OP_SIZE;
+		ctx->ok = ufs_write(fd, buf + pos, part) == part;
+	}
+	ctx->ok = ctx->ok &&
+		  ufs_pread(fd, buf2, THREAD_FILE_SIZE, 0) == THREAD_FILE_SIZE &&
+		  memcmp(buf, buf2, THREAD_FILE_SIZE) == 0;
+	/* The shared file through the shared descriptor. */
+	for (int pos = ctx->id; pos < THREAD_FILE_SIZE && ctx->ok;
+	     pos += THREAD_OP_SIZE) {
+		ssize_t rc = ufs_pread(ctx->shared_fd, buf2, THREAD_OP_SIZE,
+				       pos);
+		ctx->ok = rc > 0 &&
+			  memcmp(buf2, thread_shared_data + pos, rc) == 0;
+	}
+	/* Errors stay in the thread. */
+	ufs_seek(fd, -1, UFS_SEEK_SET);
+	ctx->error = ufs_errno();
+	ctx->ok = ctx->ok && ufs_close(fd) == 0 && ufs_delete(name) == 0;
+	free(buf2);
+	free(buf);
+	return NULL;
+}
+
+static void
+test_threads(void)
+{
+	unit_test_start();
+
+	for (int i = 0; i < THREAD_FILE_SIZE; ++i)
+		thread_shared_data[i] = i % 251;
+	int fd = ufs_open("shared", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, thread_shared_data, THREAD_FILE_SIZE) !=
+		     THREAD_FILE_SIZE);
+	unit_fail_if(ufs_open("not exists", 0) != -1);
+
+	pthread_t threads[THREAD_COUNT];
+	struct thread_ctx ctx[THREAD_COUNT];
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		ctx[i].id = i;
+		ctx[i].shared_fd = fd;
+		unit_fail_if(pthread_create(&threads[i], NULL, thread_worker,
+					    &ctx[i]) != 0);
+	}
+	bool ok = true;
+	bool error_ok = true;
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		pthread_join(threads[i], NULL);
+		ok = ok && ctx[i].ok;
+		error_ok = error_ok &&
+			   ctx[i].error == UFS_ERR_INVALID_ARGUMENT;
+	}
+	unit_check(ok, "threads use their own and a shared file");
+	unit_check(error_ok, "threads see their errors");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE,
+		   "the error of the main thread is kept");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("shared") != 0);
+
+	unit_test_finish();
+}
+
+static void *
+thread_shared_writer(void *arg)
+{
+	int fd = *(int *)arg;
+	char buf[THREAD_OP_SIZE];
+	for (int i = 0; i < 100; ++i) {
+		/* A chunk is filled with one byte, so an overlap is seen. */
+		memset(buf, i, sizeof(buf));
+		if (ufs_write(fd, buf, sizeof(buf)) != sizeof(buf))
+			return (void *)1;
+	}
+	return NULL;
+}
+
+static void
+test_shared_position(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	pthread_t threads[THREAD_COUNT];
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		unit_fail_if(pthread_create(&threads[i], NULL,
+					    thread_shared_writer, &fd) != 0);
+	}
+	bool ok = true;
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		void *rc;
+		pthread_join(threads[i], &rc);
+		ok = ok && rc == NULL;
+	}
+	unit_check(ok, "threads write through one descriptor");
+	int size = THREAD_COUNT * 100 * THREAD_OP_SIZE;
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_END) == size,
+		   "no write is lost");
+	char *buf = malloc(size);
+	unit_fail_if(ufs_pread(fd, buf, size, 0) != size);
+	for (int i = 0; i < size && ok; i += THREAD_OP_SIZE) {
+		for (int j = 1; j < THREAD_OP_SIZE && ok; ++j)
+			ok = buf[i + j] == buf[i];
+	}
+	unit_check(ok, "writes do not overlap");
+	free(buf);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void *
+thread_sync(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < 20; ++i) {
+		if (ufs_sync() != 0)
+			return (void *)1;
+	}
+	return NULL;
+}
+
+static void
+test_image(void)
+{
+	unit_test_start();
+
+	const char *path = "test_image.ufs";
+	unlink(path);
+	unit_check(ufs_mount(path, 4096) == -1, "too small image");
+	unit_check(ufs_errno() == UFS_ERR_IO, "errno is set");
+	unlink(path);
+	unit_check(ufs_mount(path, 16 * 1024 * 1024) == 0, "new image");
+	unit_check(ufs_mount(path, 16 * 1024 * 1024) == -1, "mount twice");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARGUMENT, "errno is set");
+	int size = 3 * 1024 * 1024 + 12345;
+	char *buf = malloc(size);
+	char *buf2 = malloc(size);
+	for (int i = 0; i < size; ++i)
+		buf[i] = i % 127;
+	int fd = ufs_open("big", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, buf, size) != size);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("small", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, "hello", 5) != 5);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("deleted", UFS_CREATE);
+	unit_fail_if(fd == -1 || ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("deleted") != 0);
+	char name[64];
+	memset(name, 'n', sizeof(name) - 1);
+	name[sizeof(name) - 1] = 0;
+	unit_check(ufs_open(name, UFS_CREATE) == -1, "too long name");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARGUMENT, "errno is set");
+	ufs_destroy();
+
+	unit_check(ufs_mount(path, 0) == 0, "mount again");
+	fd = ufs_open("big", 0);
+	unit_check(fd != -1, "the file is kept");
+	unit_check(ufs_read(fd, buf2, size) == size &&
+		   memcmp(buf, buf2, size) == 0, "its data is kept");
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("small", 0);
+	unit_check(fd != -1 && ufs_read(fd, buf2, 10) == 5 &&
+		   memcmp(buf2, "hello", 5) == 0, "another file is kept");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_open("deleted", 0) == -1, "deleted file is gone");
+
+	pthread_t threads[4];
+	for (int i = 0; i < 4; ++i)
+		unit_fail_if(pthread_create(&threads[i], NULL, thread_sync,
+					    NULL) != 0);
+	bool ok = true;
+	for (int i = 0; i < 4; ++i) {
+		void *rc;
+		pthread_join(threads[i], &rc);
+		ok = ok && rc == NULL;
+	}
+	unit_check(ok, "checkpoints from several threads");
+	ufs_destroy();
+	unit_check(ufs_errno() == UFS_ERR_NO_ERR, "the last checkpoint is made");
+	unit_check(ufs_mount(path, 0) == 0, "mount after the checkpoints");
+	unit_check(ufs_open("small", 0) != -1, "the files are kept");
+	ufs_destroy();
+
+	/* A crash keeps the files of the last checkpoint. */
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (ufs_mount(path, 0) != 0)
+			_exit(1);
+		fd = ufs_open("synced", UFS_CREATE);
+		ufs_write(fd, "data", 4);
+		ufs_delete("small");
+		if (ufs_sync() != 0)
+			_exit(1);
+		ufs_delete("big");
+		fd = ufs_open("lost", UFS_CREATE);
+		ufs_write(fd, buf, size);
+		_exit(0);
+	}
+	int status;
+	unit_fail_if(waitpid(pid, &status, 0) != pid);
+	unit_check(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+		   "crashed after a checkpoint");
+	unit_check(ufs_mount(path, 0) == 0, "mount after the crash");
+	fd = ufs_open("synced", 0);
+	unit_check(fd != -1 && ufs_read(fd, buf2, 10) == 4 &&
+		   memcmp(buf2, "data", 4) == 0, "the checkpoint is kept");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_open("small", 0) == -1, "deleted before it is gone");
+	unit_check(ufs_open("lost", 0) == -1, "created after it is gone");
+	fd = ufs_open("big", 0);
+	unit_check(fd != -1 && ufs_read(fd, buf2, size) == size &&
+		   memcmp(buf, buf2, size) == 0,
+		   "deleted after it is kept with its data");
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_destroy();
+
+	free(buf2);
+	free(buf);
+	unlink(path);
+
+	unit_test_finish();
+}
+
+/**
+ * Change a word of the image file, check that the mount fails, and put the
+ * word back.
+ */
+static void
+check_corrupt_word(const char *path, off_t offset, uint32_t value,
+		   const char *msg)
+{
+	int fd = open(path, O_RDWR);
+	uint32_t old;
+	unit_fail_if(fd == -1 || pread(fd, &old, 4, offset) != 4);
+	unit_fail_if(pwrite(fd, &value, 4, offset) != 4);
+	unit_check(ufs_mount(path, 0) == -1 && ufs_errno() == UFS_ERR_IO, msg);
+	unit_fail_if(pwrite(fd, &old, 4, offset) != 4);
+	close(fd);
+}
+
+static void
+test_image_corrupt(void)
+{
+	unit_test_start();
+
+	const char *path = "test_image.ufs";
+	unlink(path);
+	unit_fail_if(ufs_mount(path, 16 * 1024 * 1024) != 0);
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1 || ufs_write(fd, "hello", 5) != 5);
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_destroy();
+
+	/*
+	 * Words of the superblock: 3 - inodes, 4 and 5 - copy starts,
+	 * 6 - bitmap blocks, 7 - inode blocks, 8 - data start, 9 - data
+	 * blocks, 10 - active copy, 11 and 12 - files in the copies.
+	 */
+	uint32_t sb[13];
+	fd = open(path, O_RDWR);
+	unit_fail_if(fd == -1 || pread(fd, sb, sizeof(sb), 0) != sizeof(sb));
+	/* A copy is the bitmap, the inodes and the dirents. */
+	off_t copy = (off_t)sb[4 + sb[10]] * 4096;
+	off_t inode = copy + (off_t)sb[6] * 4096;
+	off_t dirent = inode + (off_t)sb[7] * 4096;
+	char name[8];
+	unit_fail_if(pread(fd, name, sizeof(name), dirent) != sizeof(name));
+	unit_fail_if(strcmp(name, "file") != 0);
+
+	check_corrupt_word(path, dirent + 56, sb[3], "bad inode index");
+	check_corrupt_word(path, inode + 4, 1000, "too many extents");
+	check_corrupt_word(path, inode + 8, sb[9], "block out of the image");
+	check_corrupt_word(path, inode, 4097, "size beyond the extents");
+	check_corrupt_word(path, 32, sb[8] - 1, "bad data start");
+	check_corrupt_word(path, 40, 2, "bad active copy");
+	check_corrupt_word(path, 44 + 4 * sb[10], sb[3] + 1, "too many files");
+	char long_name[56];
+	memset(long_name, 'n', sizeof(long_name));
+	unit_fail_if(pwrite(fd, long_name, sizeof(long_name), dirent) !=
+		     sizeof(long_name));
+	unit_check(ufs_mount(path, 0) == -1 && ufs_errno() == UFS_ERR_IO,
+		   "name without the end");
+	memset(long_name, 0, sizeof(long_name));
+	strcpy(long_name, "file");
+	unit_fail_if(pwrite(fd, long_name, sizeof(long_name), dirent) !=
+		     sizeof(long_name));
+	unit_fail_if(ftruncate(fd, 8 * 1024 * 1024) != 0);
+	unit_check(ufs_mount(path, 0) == -1 && ufs_errno() == UFS_ERR_IO,
+		   "truncated image");
+	unit_fail_if(ftruncate(fd, 16 * 1024 * 1024) != 0);
+	close(fd);
+
+	unit_check(ufs_mount(path, 0) == 0, "mount the image put back");
+	fd = ufs_open("file", 0);
+	char buf[8];
+	unit_check(fd != -1 && ufs_read(fd, buf, sizeof(buf)) == 5 &&
+		   memcmp(buf, "hello", 5) == 0, "the file is kept");
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_destroy();
+	unlink(path);
+
+	unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -452,8 +1002,17 @@ main(void)
 	test_delete();
 	test_stress_open();
 	test_max_file_size();
+	test_extent_borders();
 	test_rights();
 	test_resize();
+	test_resize_grow();
+	test_positional();
+	test_vectors();
+	test_reuse();
+	test_threads();
+	test_shared_position();
+	test_image();
+	test_image_corrupt();
 
 	/* Free the memory to make the memory leak detector happy. */
 	ufs_destroy();
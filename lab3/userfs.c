@@ -1,519 +1,1558 @@
 #include "userfs.h"
+#include <fcntl.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
+/**
+ * File data is kept in extents. The first one is 4 KB, each next one is
+ * twice bigger up to 1 MB, and then they all are 1 MB. Small files take
+ * little memory, and big ones take a malloc per megabyte.
+ */
 enum
 {
-	BLOCK_SIZE = 512,
+	MIN_EXTENT_SHIFT = 12,
+	MAX_EXTENT_SHIFT = 20,
+	MAX_EXTENT_SIZE = 1 << MAX_EXTENT_SHIFT,
+	/** Extents of growing size: 4 KB, 8 KB, ..., 1 MB. */
+	GROWING_EXTENTS = MAX_EXTENT_SHIFT - MIN_EXTENT_SHIFT + 1,
+	/** Where the growing extents end. */
+	GROWING_EXTENTS_SIZE = ((1 << GROWING_EXTENTS) - 1) << MIN_EXTENT_SHIFT,
 	MAX_FILE_SIZE = 1024 * 1024 * 100,
-	MAX_NUMBER_OF_BLOCKS = 204800,
+	/** Descriptors the table starts with, it doubles after that. */
+	MIN_FILE_DESCRIPTORS = 16,
+	/** Slabs for up to MIN_FILE_DESCRIPTORS << 26 descriptors. */
+	MAX_FILE_DESCRIPTOR_SLABS = 27,
+	MAX_NUMBER_OF_EXTENTS = GROWING_EXTENTS +
+		(MAX_FILE_SIZE - GROWING_EXTENTS_SIZE + MAX_EXTENT_SIZE - 1) / MAX_EXTENT_SIZE,
+	/** Bytes of free extents kept for reuse, per extent size. */
+	EXTENT_POOL_SIZE = 8 * 1024 * 1024,
+	/** Extents of an image are runs of its blocks, as big as the smallest extent. */
+	IMAGE_BLOCK_SIZE = 1 << MIN_EXTENT_SHIFT,
+	IMAGE_MAGIC = 0x31534655,
+	IMAGE_VERSION = 1,
+	/** Longest file name in an image, with the terminating zero. */
+	IMAGE_NAME_SIZE = 56,
+	/** An inode per so many bytes of an image. */
+	IMAGE_BYTES_PER_INODE = 64 * 1024,
+	IMAGE_MIN_INODES = 64,
+};
+
+/** Error code of the thread. Set from any function on any error. */
+static __thread enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+
+/**
+ * The names, the file lists and the descriptor table are guarded by
+ * fs_lock. The data and the size of a file are guarded by the lock of the
+ * file, so the files are used in parallel. A position of a descriptor is
+ * changed under its own lock and the file lock, or under the exclusive
+ * file lock alone. A descriptor lock is taken before the file lock, and a
+ * file lock after fs_lock, never before.
+ */
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Extents of the deleted and shrunk files are kept for new writes, in a
+ * free list per extent size. A free extent keeps the next one in its first
+ * bytes, so it is taken and given back in O(1) with no memory besides its
+ * own. Up to EXTENT_POOL_SIZE is kept per size, the rest is freed. Each
+ * list has its own lock, taken after any other.
+ */
+struct extent_pool
+{
+	pthread_mutex_t lock;
+	char *first;
+	int count;
+};
+
+static struct extent_pool extent_pools[GROWING_EXTENTS] = {
+	[0 ... GROWING_EXTENTS - 1] = {PTHREAD_MUTEX_INITIALIZER, NULL, 0},
+};
+
+/**
+ * An image file keeps the filesystem on disk, mapped into memory. The
+ * superblock is followed by two copies of the metadata, and then by the
+ * data blocks. A copy has the block bitmap, the inodes and the directory
+ * entries, each packed from the start, so a checkpoint writes them
+ * sequentially.
+ *
+ * The data is written right into the mapped blocks, and the metadata is
+ * kept in memory as usual. A checkpoint writes it into the copy which is
+ * not active, syncs everything, and then makes that copy active in the
+ * superblock. A crash leaves the metadata of the last checkpoint. Its
+ * blocks are not given to new extents until the next checkpoint, even if
+ * they are freed, so its files keep their data.
+ */
+struct image_superblock
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t block_count;
+	uint32_t inode_count;
+	/** Start blocks of the metadata copies. */
+	uint32_t copy_start[2];
+	/** Blocks of the bitmap and of the inodes in a copy. */
+	uint32_t bitmap_blocks;
+	uint32_t inode_blocks;
+	uint32_t data_start;
+	uint32_t data_blocks;
+	/** The copy of the last checkpoint. */
+	uint32_t active;
+	/** Files in each copy. */
+	uint32_t file_count[2];
+	uint64_t generation;
+};
+
+struct image_inode
+{
+	uint32_t size;
+	uint32_t number_of_extents;
+	/** First data block of each extent. */
+	uint32_t extents[MAX_NUMBER_OF_EXTENTS];
 };
 
-/** Global error code. Set from any function on any error. */
-static enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
-
-struct block
-{
-	/** Block memory. */
-	char *memory;
-	/** How many bytes of memory are occupied. */
-	int occupied;
-	/** Next block in the file. */
-	struct block *next;
-	/** Previous block in the file. */
-	struct block *prev;
-	/*position in linked list of file*/
-	int id;
+struct image_dirent
+{
+	char name[IMAGE_NAME_SIZE];
+	uint32_t inode;
+	uint32_t reserved;
 };
 
+/**
+ * The mounted image. The blocks in use are marked in the bitmap in memory.
+ * A block is free if it is marked neither there nor in the bitmap of the
+ * active copy, nor in the one being written by a checkpoint. The lock
+ * guards the bitmaps and is taken after any other. Checkpoints go one at
+ * a time under checkpoint_lock, which is taken before any other.
+ */
+static struct
+{
+	int fd;
+	char *map;
+	size_t size;
+	struct image_superblock *sb;
+	char *data;
+	uint64_t *used;
+	/** The copy being written by a checkpoint, or -1. */
+	int writing;
+	/** Where to look for a free extent of each size next time. */
+	uint32_t next_slot[GROWING_EXTENTS];
+	pthread_mutex_t lock;
+	pthread_mutex_t checkpoint_lock;
+} image = {.fd = -1, .writing = -1, .lock = PTHREAD_MUTEX_INITIALIZER,
+	.checkpoint_lock = PTHREAD_MUTEX_INITIALIZER};
+
 struct file
 {
-	/** Double-linked list of file blocks. */
-	struct block *block_list;
+	/**
+	 * Reads share the lock, and so do writes inside the file, since
+	 * they do not change its extents and size. The writes which grow
+	 * the file and resize take it exclusively.
+	 */
+	pthread_rwlock_t lock;
+	/** Memory of the extents of the file, by their number. */
+	char **extents;
+	int extent_capacity;
 
 	/** How many file descriptors are opened on the file. */
 	int refs_n;
 	/** File name. */
 	char *file_name;
-	/** Files are stored in a double-linked list. */
+	/**
+	 * Files are stored in a double-linked list: the live ones in
+	 * file_list, the deleted but still opened ones in
+	 * deleted_file_list.
+	 */
 	struct file *next;
 	struct file *prev;
-	int number_of_blocks;
+	/** Next live file in the same bucket of the name table. */
+	struct file *hash_next;
+	uint32_t hash;
+	int number_of_extents;
 	int deleted;
 	int size;
 };
 
-/** List of all files. */
+/** List of the live files. */
 static struct file *file_list = NULL;
+/**
+ * Files deleted while they had opened descriptors. They are not seen by
+ * name, and live until the last descriptor is closed.
+ */
+static struct file *deleted_file_list = NULL;
+
+/**
+ * Hash table of the live files by name, so a file is found without
+ * comparing the name with every other file. The number of buckets is a
+ * power of 2, and is doubled when the files outnumber them.
+ */
+static struct file **file_table = NULL;
+static int file_table_size = 0;
+static int file_table_count = 0;
 
 struct filedesc
 {
+	/** NULL if the descriptor is closed. */
 	struct file *file;
 	int fd;
+	/** Next closed descriptor, -1 if there is none. */
+	int next_free;
 	// For permissions flags
 	int permissions;
-	int read_write_pointer;
 	/**
-	 * Last block in the list of blocks for fast access to the end
-	 * of file.
+	 * Taken by the calls moving the position, so the threads sharing
+	 * the descriptor read and write one after another.
 	 */
-	struct block *last_block;
+	pthread_mutex_t position_lock;
+	int read_write_pointer;
 };
 
 /**
- * An array of file descriptors. When a file descriptor is
- * created, its pointer drops here. When a file descriptor is
- * closed, its place in this array is set to NULL and can be
- * taken by next ufs_open() call.
+ * The file descriptors, allocated by slabs when the table grows. The
+ * first slab has MIN_FILE_DESCRIPTORS of them, and each next one doubles
+ * the table, so the slab of a descriptor is found from its number. The
+ * slabs never move, and a descriptor is looked up without fs_lock. A
+ * closed descriptor has no file, and is pushed to the list of free ones
+ * starting at first_free_fd. ufs_open() takes the first of them.
  */
-static struct filedesc **file_descriptors = NULL;
+static struct filedesc *file_descriptor_slabs[MAX_FILE_DESCRIPTOR_SLABS];
 static int file_descriptor_count = 0;
 static int file_descriptor_capacity = 0;
+static int first_free_fd = -1;
 enum ufs_error_code
 ufs_errno()
 {
 	return ufs_error_code;
 }
 
-// Search file list to check if a file with this name exists.
+static struct filedesc *
+filedesc_at(int fd)
+{
+	if (fd < MIN_FILE_DESCRIPTORS)
+	{
+		return &file_descriptor_slabs[0][fd];
+	}
+	int slab = 32 - __builtin_clz(fd / MIN_FILE_DESCRIPTORS);
+	return &file_descriptor_slabs[slab][fd - (MIN_FILE_DESCRIPTORS << (slab - 1))];
+}
+
+/**
+ * Double the descriptor table, with a slab of free descriptors. Returns
+ * -1 if there is no memory or no more slabs.
+ */
+static int
+file_descriptors_grow(void)
+{
+	int old_capacity = file_descriptor_capacity;
+	int new_capacity = old_capacity ? old_capacity * 2 : MIN_FILE_DESCRIPTORS;
+	int slab_id = old_capacity ? 32 - __builtin_clz(old_capacity / MIN_FILE_DESCRIPTORS) : 0;
+	if (slab_id >= MAX_FILE_DESCRIPTOR_SLABS)
+	{
+		return -1;
+	}
+	struct filedesc *slab = malloc((new_capacity - old_capacity) * sizeof(struct filedesc));
+	if (slab == NULL)
+	{
+		return -1;
+	}
+	// Linked in order, so the lower descriptors are taken first.
+	for (int i = old_capacity; i < new_capacity; i++)
+	{
+		struct filedesc *desc = &slab[i - old_capacity];
+		desc->file = NULL;
+		desc->fd = i;
+		desc->next_free = i + 1 < new_capacity ? i + 1 : first_free_fd;
+		pthread_mutex_init(&desc->position_lock, NULL);
+	}
+	file_descriptor_slabs[slab_id] = slab;
+	first_free_fd = old_capacity;
+	// The readers without fs_lock see the slab before the new capacity.
+	__atomic_store_n(&file_descriptor_capacity, new_capacity, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/** The opened descriptor, or NULL with the error set. */
+static struct filedesc *
+filedesc_get(int fd)
+{
+	if (fd < 0 || fd >= __atomic_load_n(&file_descriptor_capacity, __ATOMIC_ACQUIRE))
+	{
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return NULL;
+	}
+	struct filedesc *desc = filedesc_at(fd);
+	if (__atomic_load_n(&desc->file, __ATOMIC_ACQUIRE) == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return NULL;
+	}
+	return desc;
+}
+
+// FNV-1a.
+static uint32_t
+file_name_hash(const char *filename)
+{
+	uint32_t h = 2166136261u;
+	for (; *filename != '\0'; filename++)
+	{
+		h = (h ^ (unsigned char)*filename) * 16777619u;
+	}
+	return h;
+}
+
+static struct file **
+file_table_slot(const char *filename, uint32_t hash)
+{
+	if (file_table_size == 0)
+	{
+		return NULL;
+	}
+	struct file **slot = &file_table[hash & (file_table_size - 1)];
+	while (*slot != NULL && ((*slot)->hash != hash || strcmp((*slot)->file_name, filename)))
+	{
+		slot = &(*slot)->hash_next;
+	}
+	return slot;
+}
+
+static void
+file_table_add(struct file *my_file)
+{
+	if (file_table_count >= file_table_size)
+	{
+		int new_size = file_table_size ? file_table_size * 2 : 64;
+		struct file **table = calloc(new_size, sizeof(struct file*));
+		for (int i = 0; i < file_table_size; i++)
+		{
+			struct file *current = file_table[i];
+			while (current != NULL)
+			{
+				struct file *next = current->hash_next;
+				struct file **bucket = &table[current->hash & (new_size - 1)];
+				current->hash_next = *bucket;
+				*bucket = current;
+				current = next;
+			}
+		}
+		free(file_table);
+		file_table = table;
+		file_table_size = new_size;
+	}
+	struct file **bucket = &file_table[my_file->hash & (file_table_size - 1)];
+	my_file->hash_next = *bucket;
+	*bucket = my_file;
+	file_table_count++;
+}
+
+static void
+file_table_remove(struct file *my_file)
+{
+	struct file **slot = &file_table[my_file->hash & (file_table_size - 1)];
+	while (*slot != my_file)
+	{
+		slot = &(*slot)->hash_next;
+	}
+	*slot = my_file->hash_next;
+	file_table_count--;
+}
+
+static void
+file_list_add(struct file **list, struct file *my_file)
+{
+	my_file->prev = NULL;
+	my_file->next = *list;
+	if (*list != NULL)
+	{
+		(*list)->prev = my_file;
+	}
+	*list = my_file;
+}
+
+static void
+file_list_remove(struct file **list, struct file *my_file)
+{
+	if (my_file->prev != NULL)
+	{
+		my_file->prev->next = my_file->next;
+	}
+	else
+	{
+		*list = my_file->next;
+	}
+	if (my_file->next != NULL)
+	{
+		my_file->next->prev = my_file->prev;
+	}
+}
+
+// Find the live file with this name. Deleted files are not seen.
 struct file *search_files_for(const char *filename)
 {
-	for (struct file *i = file_list; i != NULL; i = i->next)
+	struct file **slot = file_table_slot(filename, file_name_hash(filename));
+	return slot != NULL ? *slot : NULL;
+}
+
+/** A new empty file, added to the name table and the file list. */
+static struct file *
+file_new(const char *filename)
+{
+	struct file *my_file = malloc(sizeof(struct file));
+	pthread_rwlock_init(&my_file->lock, NULL);
+	my_file->file_name = strdup(filename);
+	my_file->hash = file_name_hash(filename);
+	my_file->refs_n = 0;
+	my_file->extents = NULL;
+	my_file->extent_capacity = 0;
+	my_file->number_of_extents = 0;
+	my_file->deleted = 0;
+	my_file->size = 0;
+	file_table_add(my_file);
+	file_list_add(&file_list, my_file);
+	return my_file;
+}
+
+int ufs_open(const char *filename, int flags)
+{
+	pthread_mutex_lock(&fs_lock);
+	if (first_free_fd == -1 && file_descriptors_grow() != 0)
+	{
+		pthread_mutex_unlock(&fs_lock);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	struct file *my_file = search_files_for(filename);
+	if (my_file == NULL)
 	{
-		// This loop may find partially deleted files along the way but it will
-		// ignore them and return the latest added file.
-		// Partially deleted files are only kept until all FDs pointing to them are closed.
-		if (!i->deleted && !strcmp(i->file_name, filename))
+		if(!(flags & 1))
 		{
-			return i;
+			pthread_mutex_unlock(&fs_lock);
+			ufs_error_code = UFS_ERR_NO_FILE;
+			return -1;
 		}
-		if(i == i->next)
+		// An image has room for a limited number of files and names.
+		if (image.map != NULL && (strlen(filename) >= IMAGE_NAME_SIZE
+			|| file_table_count >= (int)image.sb->inode_count))
 		{
-			break;
+			pthread_mutex_unlock(&fs_lock);
+			ufs_error_code = strlen(filename) >= IMAGE_NAME_SIZE ?
+				UFS_ERR_INVALID_ARGUMENT : UFS_ERR_NO_MEM;
+			return -1;
 		}
+		my_file = file_new(filename);
 	}
-	return NULL;
+	my_file->refs_n += 1;
+
+	int my_fd = first_free_fd;
+	struct filedesc *new_fd = filedesc_at(my_fd);
+	first_free_fd = new_fd->next_free;
+	new_fd->permissions = flags;
+	new_fd->read_write_pointer = 0;
+	__atomic_store_n(&new_fd->file, my_file, __ATOMIC_RELEASE);
+	file_descriptor_count += 1;
+	pthread_mutex_unlock(&fs_lock);
+	ufs_error_code = UFS_ERR_NO_ERR;
+	return my_fd;
 }
 
-int ufs_open(const char *filename, int flags)
+static int
+extent_size(int id)
+{
+	return id < GROWING_EXTENTS ? 1 << (MIN_EXTENT_SHIFT + id) : MAX_EXTENT_SIZE;
+}
+
+/**
+ * Number of the extent holding the byte at pos, and the offset in it. The
+ * growing extent k starts at (2^k - 1) * 4 KB, so k is the highest bit of
+ * pos / 4 KB + 1.
+ */
+static int
+extent_of(int pos, int *offset)
+{
+	if (pos < GROWING_EXTENTS_SIZE)
+	{
+		unsigned n = ((unsigned)pos >> MIN_EXTENT_SHIFT) + 1;
+		int id = 31 - __builtin_clz(n);
+		*offset = pos - (((1 << id) - 1) << MIN_EXTENT_SHIFT);
+		return id;
+	}
+	pos -= GROWING_EXTENTS_SIZE;
+	*offset = pos & (MAX_EXTENT_SIZE - 1);
+	return GROWING_EXTENTS + (pos >> MAX_EXTENT_SHIFT);
+}
+
+static uint64_t *
+image_bitmap(int copy)
+{
+	return (uint64_t *)(image.map + (size_t)image.sb->copy_start[copy] * IMAGE_BLOCK_SIZE);
+}
+
+static struct image_inode *
+image_inodes(int copy)
+{
+	return (struct image_inode *)(image.map + ((size_t)image.sb->copy_start[copy]
+		+ image.sb->bitmap_blocks) * IMAGE_BLOCK_SIZE);
+}
+
+static struct image_dirent *
+image_dirents(int copy)
+{
+	return (struct image_dirent *)(image.map + ((size_t)image.sb->copy_start[copy]
+		+ image.sb->bitmap_blocks + image.sb->inode_blocks) * IMAGE_BLOCK_SIZE);
+}
+
+/**
+ * Mark or check the run of count blocks from first. A run is aligned by
+ * its size, so a short one lies in one word of a bitmap, and a long one
+ * takes whole words.
+ */
+static int
+image_blocks_are_used(const uint64_t *bitmap, uint32_t first, uint32_t count)
 {
-	if (file_descriptor_capacity == file_descriptor_count)
+	if (count < 64)
+	{
+		uint64_t mask = ((1ULL << count) - 1) << (first % 64);
+		return (bitmap[first / 64] & mask) != 0;
+	}
+	for (uint32_t i = first / 64; i < (first + count) / 64; i++)
 	{
-		if (file_descriptor_capacity)
+		if (bitmap[i] != 0)
 		{
-			file_descriptor_capacity *= 2;
+			return 1;
 		}
-		else
+	}
+	return 0;
+}
+
+static int
+image_blocks_free(uint32_t first, uint32_t count)
+{
+	const uint64_t *active = image_bitmap(image.sb->active);
+	// Without a checkpoint, the active bitmap is checked twice.
+	const uint64_t *writing = image_bitmap(image.writing >= 0 ? image.writing : (int)image.sb->active);
+	if (count < 64)
+	{
+		uint64_t mask = ((1ULL << count) - 1) << (first % 64);
+		int i = first / 64;
+		return ((image.used[i] | active[i] | writing[i]) & mask) == 0;
+	}
+	for (uint32_t i = first / 64; i < (first + count) / 64; i++)
+	{
+		if ((image.used[i] | active[i] | writing[i]) != 0)
 		{
-			file_descriptor_capacity = 1;
+			return 0;
 		}
-		file_descriptors =
-			realloc(file_descriptors, file_descriptor_capacity * sizeof(struct filedesc*));
-		for(int i = file_descriptor_count; i < file_descriptor_capacity; i++)
+	}
+	return 1;
+}
+
+static void
+image_blocks_mark(uint64_t *bitmap, uint32_t first, uint32_t count, int used)
+{
+	if (count < 64)
+	{
+		uint64_t mask = ((1ULL << count) - 1) << (first % 64);
+		bitmap[first / 64] = used ? bitmap[first / 64] | mask : bitmap[first / 64] & ~mask;
+		return;
+	}
+	for (uint32_t i = first / 64; i < (first + count) / 64; i++)
+	{
+		bitmap[i] = used ? ~0ULL : 0;
+	}
+}
+
+static uint32_t
+image_extent_blocks(int id)
+{
+	return extent_size(id) / IMAGE_BLOCK_SIZE;
+}
+
+/** Blocks for the extent with the number id, or NULL if the image is full. */
+static char *
+image_extent_new(int id)
+{
+	int size_id = id < GROWING_EXTENTS ? id : GROWING_EXTENTS - 1;
+	uint32_t count = image_extent_blocks(id);
+	uint32_t slots = image.sb->data_blocks / count;
+	char *extent = NULL;
+	pthread_mutex_lock(&image.lock);
+	// Next fit: the search goes on from the last found extent.
+	for (uint32_t i = 0; i < slots && extent == NULL; i++)
+	{
+		uint32_t slot = (image.next_slot[size_id] + i) % slots;
+		if (image_blocks_free(slot * count, count))
 		{
-			file_descriptors[i] = NULL;
+			image_blocks_mark(image.used, slot * count, count, 1);
+			image.next_slot[size_id] = slot + 1;
+			extent = image.data + (size_t)slot * count * IMAGE_BLOCK_SIZE;
 		}
 	}
+	pthread_mutex_unlock(&image.lock);
+	return extent;
+}
+
+static uint32_t
+image_block_of(const char *extent)
+{
+	return (extent - image.data) / IMAGE_BLOCK_SIZE;
+}
 
-	struct file *my_file;
-	if (file_list == NULL || search_files_for(filename) == NULL)
+/** Memory for the extent with the number id, from the pool if it has any. */
+static char *
+extent_new(int id)
+{
+	if (image.map != NULL)
 	{
-		if(!(flags & 1))
+		return image_extent_new(id);
+	}
+	struct extent_pool *pool = &extent_pools[id < GROWING_EXTENTS ? id : GROWING_EXTENTS - 1];
+	pthread_mutex_lock(&pool->lock);
+	char *extent = pool->first;
+	if (extent != NULL)
+	{
+		pool->first = *(char **)extent;
+		pool->count--;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return extent != NULL ? extent : malloc(extent_size(id));
+}
+
+static void
+extent_delete(int id, char *extent)
+{
+	if (image.map != NULL)
+	{
+		pthread_mutex_lock(&image.lock);
+		image_blocks_mark(image.used, image_block_of(extent), image_extent_blocks(id), 0);
+		pthread_mutex_unlock(&image.lock);
+		return;
+	}
+	int pool_id = id < GROWING_EXTENTS ? id : GROWING_EXTENTS - 1;
+	struct extent_pool *pool = &extent_pools[pool_id];
+	pthread_mutex_lock(&pool->lock);
+	if ((pool->count + 1) * (size_t)extent_size(pool_id) <= EXTENT_POOL_SIZE)
+	{
+		*(char **)extent = pool->first;
+		pool->first = extent;
+		pool->count++;
+		extent = NULL;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	free(extent);
+}
+
+/**
+ * Memory of the extent with the number id. With create set, the missing
+ * extents up to it are added. Returns NULL if there is no such extent, or no
+ * memory for it.
+ */
+static char *
+file_extent_at(struct file *my_file, int id, int create)
+{
+	if (id < my_file->number_of_extents)
+	{
+		return my_file->extents[id];
+	}
+	if (!create || id >= MAX_NUMBER_OF_EXTENTS)
+	{
+		return NULL;
+	}
+	if (id >= my_file->extent_capacity)
+	{
+		int capacity = my_file->extent_capacity ? my_file->extent_capacity : 4;
+		while (capacity <= id)
 		{
-			ufs_error_code = UFS_ERR_NO_FILE;
-			return -1;
+			capacity *= 2;
 		}
-		my_file = malloc(sizeof(struct file));
-		my_file->file_name = strdup(filename);
-		my_file->prev = NULL;
-		my_file->next = NULL;
-		my_file->refs_n = 1;
-		my_file->block_list = NULL;
-		my_file->number_of_blocks = 0;
-		my_file->deleted = 0;
-		my_file->size = 0;
-		if (file_list == NULL)
+		char **extents = realloc(my_file->extents, capacity * sizeof(char*));
+		if (extents == NULL)
 		{
-			file_list = my_file;
+			return NULL;
 		}
-		else
+		my_file->extents = extents;
+		my_file->extent_capacity = capacity;
+	}
+	while (my_file->number_of_extents <= id)
+	{
+		char *extent = extent_new(my_file->number_of_extents);
+		if (extent == NULL)
 		{
-			for (struct file *i = file_list; i != NULL; i = i->next)
-			{
-				if (i->next == NULL)
-				{
-					my_file->prev = i;
-					i->next = my_file;
-					break;
-				}
-			}
+			return NULL;
 		}
+		my_file->extents[my_file->number_of_extents++] = extent;
 	}
-	else
+	return my_file->extents[id];
+}
+
+/** Free the extents from the number count to the end of the file. */
+static void
+file_truncate_extents(struct file *my_file, int count)
+{
+	for (int i = count; i < my_file->number_of_extents; i++)
 	{
-		my_file = search_files_for(filename);
-		my_file->refs_n += 1;
+		extent_delete(i, my_file->extents[i]);
 	}
-
-	int my_fd = 0;
-	while (1)
+	if (count < my_file->number_of_extents)
 	{
-		if (*(file_descriptors + my_fd) == NULL)
-		{
-			break;
-		}
-		my_fd++;
+		my_file->number_of_extents = count;
 	}
+}
 
-	struct filedesc *new_fd = (struct filedesc*) malloc(sizeof(struct filedesc));
-	new_fd->file = my_file;
-	new_fd->fd = my_fd;
-	new_fd->permissions = flags;
-	new_fd->read_write_pointer = 0;
-	new_fd->last_block = my_file->block_list;
-	*(file_descriptors + my_fd) = new_fd;
-	file_descriptor_count += 1;
-	ufs_error_code = UFS_ERR_NO_ERR;
-	return my_fd;
+/**
+ * Grow the file to new_size with zeros. The tail of the last extent can
+ * keep data from before a shrink, so it is zeroed too. Returns -1 if there
+ * is no memory.
+ */
+static int
+file_grow(struct file *my_file, int new_size)
+{
+	int old_extents = my_file->number_of_extents;
+	int offset;
+	int id = extent_of(my_file->size, &offset);
+	if (id < old_extents)
+	{
+		memset(my_file->extents[id] + offset, 0, extent_size(id) - offset);
+	}
+	if (file_extent_at(my_file, extent_of(new_size - 1, &offset), 1) == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	for (int i = old_extents; i < my_file->number_of_extents; i++)
+	{
+		memset(my_file->extents[i], 0, extent_size(i));
+	}
+	my_file->size = new_size;
+	return 0;
 }
 
-int writeAtI(char c, struct block* my_block, int fd){
-	struct block* current_block = my_block;
-	int i = file_descriptors[fd]->read_write_pointer;
-	i -= (my_block->id * BLOCK_SIZE);
-	if( i < 0)
+/**
+ * Write the data at pos. A gap between the file end and pos reads as zeros.
+ * Returns how many bytes were written, or -1 with the error set if none
+ * were.
+ */
+static ssize_t
+file_write_at(struct file *my_file, const char *buf, size_t size, size_t pos)
+{
+	if (size == 0)
+	{
+		return 0;
+	}
+	if (pos >= MAX_FILE_SIZE)
 	{
-		printf("indexing error occured while writing, error at line 179\n");
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
 	}
-	struct file* my_file = file_descriptors[fd]->file;
-	if(i >= BLOCK_SIZE && current_block->next != NULL)
+	if ((int)pos > my_file->size && file_grow(my_file, (int)pos) != 0)
 	{
-		current_block = current_block->next;
-		file_descriptors[fd]->last_block = current_block;
-		i -= BLOCK_SIZE;
+		return -1;
 	}
-	else
-	if(i >= BLOCK_SIZE && current_block->id < MAX_NUMBER_OF_BLOCKS-1)
-	{
-		struct block *new_block = (struct block*) malloc(sizeof(struct block));
-		new_block->next = NULL;
-		new_block->prev = current_block;
-		new_block->occupied = 0;
-		new_block->id = current_block->id + 1;
-		new_block->memory = malloc(BLOCK_SIZE * sizeof(char));
-		current_block->next = new_block;
-		current_block = current_block->next;
-		i -= BLOCK_SIZE;
-		file_descriptors[fd]->last_block = current_block;
-	}
-	
-	if(i < BLOCK_SIZE)
-	{
-		current_block->memory[i] = c;
-
-		file_descriptors[fd]->read_write_pointer++;
-		if(my_file->size < file_descriptors[fd]->read_write_pointer)
+	size_t done = 0;
+	// Whole spans of extents are copied at once, not byte by byte.
+	while (done < size && pos + done < MAX_FILE_SIZE)
+	{
+		int at = (int)(pos + done);
+		int offset;
+		int id = extent_of(at, &offset);
+		char *extent = file_extent_at(my_file, id, 1);
+		if (extent == NULL)
+		{
+			break;
+		}
+		size_t span = extent_size(id) - offset;
+		if (span > size - done)
 		{
-			my_file->size++;
-			current_block->occupied++;
+			span = size - done;
+		}
+		if (span > (size_t)(MAX_FILE_SIZE - at))
+		{
+			span = MAX_FILE_SIZE - at;
+		}
+		memcpy(extent + offset, buf + done, span);
+		done += span;
+		if (my_file->size < at + (int)span)
+		{
+			my_file->size = at + (int)span;
 		}
 	}
-	else
+	if (done == 0)
 	{
 		ufs_error_code = UFS_ERR_NO_MEM;
 		return -1;
 	}
-	
-	return 0;
+	return done;
 }
 
-ssize_t
-ufs_write(int fd, const char *buf, size_t size)
+/** Read up to size bytes at pos. Returns how many were read, 0 at the end. */
+static ssize_t
+file_read_at(struct file *my_file, char *buf, size_t size, size_t pos)
 {
-	if (fd >= file_descriptor_capacity || fd < 0 || file_descriptors[fd] == NULL)
+	size_t done = 0;
+	while (done < size && pos + done < (size_t)my_file->size)
 	{
-		ufs_error_code = UFS_ERR_NO_FILE;
-		return -1;
+		int at = (int)(pos + done);
+		int offset;
+		int id = extent_of(at, &offset);
+		char *extent = file_extent_at(my_file, id, 0);
+		if (extent == NULL)
+		{
+			break;
+		}
+		size_t span = extent_size(id) - offset;
+		if (span > size - done)
+		{
+			span = size - done;
+		}
+		if (span > (size_t)(my_file->size - at))
+		{
+			span = my_file->size - at;
+		}
+		memcpy(buf + done, extent + offset, span);
+		done += span;
 	}
+	return done;
+}
 
-	if(file_descriptors[fd]->permissions&2)
+/** The opened descriptor allowed to write, or NULL with the error set. */
+static struct filedesc *
+filedesc_get_writable(int fd)
+{
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc != NULL && (desc->permissions & UFS_READ_ONLY))
 	{
 		ufs_error_code = UFS_ERR_NO_PERMISSION;
-		return -1;
-	}	
+		return NULL;
+	}
+	return desc;
+}
 
-	// If file has no blocks, create first block.
-	struct file *my_file = file_descriptors[fd]->file;
-	if (my_file->block_list == NULL)
+/** The opened descriptor allowed to read, or NULL with the error set. */
+static struct filedesc *
+filedesc_get_readable(int fd)
+{
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc != NULL && (desc->permissions & UFS_WRITE_ONLY))
 	{
-		struct block *new_block = (struct block*) malloc(sizeof(struct block));
-		new_block->next = NULL;
-		new_block->prev = NULL;
-		new_block->occupied = 0;
-		new_block->id = 0;
-		new_block->memory = malloc(BLOCK_SIZE * sizeof(char));
-		file_descriptors[fd]->last_block = new_block;
-		my_file->block_list = new_block;
-		my_file->number_of_blocks += 1;
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return NULL;
 	}
+	return desc;
+}
 
-	if(file_descriptors[fd]->last_block == NULL)
+/**
+ * Write the buffers at the offset, or at the position of the descriptor
+ * and move it if the offset is -1. Takes the lock of the file.
+ */
+static ssize_t
+filedesc_write(struct filedesc *desc, const struct iovec *iov, int iovcnt, ssize_t offset)
+{
+	size_t size = 0;
+	for (int i = 0; i < iovcnt; i++)
 	{
-		file_descriptors[fd]->last_block = my_file->block_list;
+		size += iov[i].iov_len;
 	}
-
-	int cur_size = 0;
-	while (cur_size != (int)size)
+	struct file *my_file = desc->file;
+	if (offset < 0)
+	{
+		pthread_mutex_lock(&desc->position_lock);
+	}
+	pthread_rwlock_rdlock(&my_file->lock);
+	size_t pos = offset < 0 ? (size_t)desc->read_write_pointer : (size_t)offset;
+	if (pos > (size_t)my_file->size || size > my_file->size - pos)
 	{
-		if((cur_size) == (int)size){
+		pthread_rwlock_unlock(&my_file->lock);
+		pthread_rwlock_wrlock(&my_file->lock);
+		pos = offset < 0 ? (size_t)desc->read_write_pointer : (size_t)offset;
+	}
+	ssize_t done = 0;
+	for (int i = 0; i < iovcnt; i++)
+	{
+		ssize_t rc = file_write_at(my_file, iov[i].iov_base, iov[i].iov_len, pos + done);
+		if (rc < 0)
+		{
+			// Only an error before anything is written is reported.
+			done = done > 0 ? done : -1;
 			break;
 		}
-		if(writeAtI(buf[cur_size], file_descriptors[fd]->last_block, fd) == -1)
+		done += rc;
+		if ((size_t)rc < iov[i].iov_len)
 		{
 			break;
 		}
-		cur_size ++;
 	}
-	if(!cur_size)
+	if (offset < 0 && done > 0)
 	{
-		return -1;
+		desc->read_write_pointer += done;
 	}
-	return cur_size;
+	pthread_rwlock_unlock(&my_file->lock);
+	if (offset < 0)
+	{
+		pthread_mutex_unlock(&desc->position_lock);
+	}
+	return done;
 }
 
-int readAtI(char* c, struct block* current_block, int fd)
+/**
+ * Read into the buffers at the offset, or at the position of the
+ * descriptor and move it if the offset is -1. Takes the lock of the file.
+ */
+static ssize_t
+filedesc_read(struct filedesc *desc, const struct iovec *iov, int iovcnt, ssize_t offset)
 {
-	int i = file_descriptors[fd]->read_write_pointer;
-	int limit = file_descriptors[fd]->file->size;
-	if(i >= limit)
+	struct file *my_file = desc->file;
+	if (offset < 0)
 	{
-		return -1;
+		pthread_mutex_lock(&desc->position_lock);
+	}
+	pthread_rwlock_rdlock(&my_file->lock);
+	size_t pos = offset < 0 ? (size_t)desc->read_write_pointer : (size_t)offset;
+	ssize_t done = 0;
+	for (int i = 0; i < iovcnt; i++)
+	{
+		ssize_t rc = file_read_at(my_file, iov[i].iov_base, iov[i].iov_len, pos + done);
+		done += rc;
+		if ((size_t)rc < iov[i].iov_len)
+		{
+			break;
+		}
+	}
+	if (offset < 0)
+	{
+		desc->read_write_pointer += done;
 	}
-	i -= (current_block->id * BLOCK_SIZE);
+	pthread_rwlock_unlock(&my_file->lock);
+	if (offset < 0)
+	{
+		pthread_mutex_unlock(&desc->position_lock);
+	}
+	return done;
+}
 
-	if( i < 0)
+ssize_t
+ufs_write(int fd, const char *buf, size_t size)
+{
+	struct filedesc *desc = filedesc_get_writable(fd);
+	if (desc == NULL)
 	{
-		printf("indexing error occured while reading, error at line 278\n");
+		return -1;
 	}
-	
-	if(i >= BLOCK_SIZE && current_block->next != NULL){
-		current_block = current_block->next;
-		file_descriptors[fd]->last_block = current_block;
-		i -= BLOCK_SIZE;
+	struct iovec iov = {(char *)buf, size};
+	return filedesc_write(desc, &iov, 1, -1);
+}
+
+ssize_t
+ufs_read(int fd, char *buf, size_t size)
+{
+	struct filedesc *desc = filedesc_get_readable(fd);
+	if (desc == NULL)
+	{
+		return -1;
 	}
+	struct iovec iov = {buf, size};
+	return filedesc_read(desc, &iov, 1, -1);
+}
 
-	if(i < BLOCK_SIZE)
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset)
+{
+	struct filedesc *desc = filedesc_get_writable(fd);
+	if (desc == NULL)
 	{
-		*c = current_block->memory[i];
-		file_descriptors[fd]->read_write_pointer++;
-		return 0;
+		return -1;
 	}
-	else
+	if (offset >= MAX_FILE_SIZE)
 	{
 		ufs_error_code = UFS_ERR_NO_MEM;
 		return -1;
 	}
-
-	return -1;
+	struct iovec iov = {(char *)buf, size};
+	return filedesc_write(desc, &iov, 1, offset);
 }
 
 ssize_t
-ufs_read(int fd, char *buf, size_t size)
+ufs_pread(int fd, char *buf, size_t size, size_t offset)
 {
-	if (fd > file_descriptor_capacity || fd < 0 || file_descriptors[fd] == NULL)
+	struct filedesc *desc = filedesc_get_readable(fd);
+	if (desc == NULL)
 	{
-		ufs_error_code = UFS_ERR_NO_FILE;
 		return -1;
 	}
+	if (offset >= MAX_FILE_SIZE)
+	{
+		return 0;
+	}
+	struct iovec iov = {buf, size};
+	return filedesc_read(desc, &iov, 1, offset);
+}
 
-	if(file_descriptors[fd]->permissions&4)
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct filedesc *desc = filedesc_get_writable(fd);
+	if (desc == NULL)
 	{
-		ufs_error_code = UFS_ERR_NO_PERMISSION;
 		return -1;
-	}	
+	}
+	if (iovcnt < 0)
+	{
+		ufs_error_code = UFS_ERR_INVALID_ARGUMENT;
+		return -1;
+	}
+	return filedesc_write(desc, iov, iovcnt, -1);
+}
 
-	if(file_descriptors[fd]->last_block == NULL)
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct filedesc *desc = filedesc_get_readable(fd);
+	if (desc == NULL)
+	{
+		return -1;
+	}
+	if (iovcnt < 0)
 	{
-		file_descriptors[fd]->last_block = file_descriptors[fd]->file->block_list;
+		ufs_error_code = UFS_ERR_INVALID_ARGUMENT;
+		return -1;
 	}
+	return filedesc_read(desc, iov, iovcnt, -1);
+}
 
-	int cur_size = 0;
-	while (1)
+int
+ufs_read_view(int fd, struct ufs_view *views, int view_count, size_t size)
+{
+	struct filedesc *desc = filedesc_get_readable(fd);
+	if (desc == NULL)
+	{
+		return -1;
+	}
+	if (view_count < 0)
+	{
+		ufs_error_code = UFS_ERR_INVALID_ARGUMENT;
+		return -1;
+	}
+	struct file *my_file = desc->file;
+	pthread_mutex_lock(&desc->position_lock);
+	pthread_rwlock_rdlock(&my_file->lock);
+	int count = 0;
+	size_t done = 0;
+	// A view per extent, the same spans as file_read_at() copies.
+	while (count < view_count && done < size
+		&& desc->read_write_pointer < my_file->size)
 	{
-		if(cur_size == (int)size)
+		int pos = desc->read_write_pointer;
+		int offset;
+		int id = extent_of(pos, &offset);
+		char *extent = file_extent_at(my_file, id, 0);
+		if (extent == NULL)
 		{
 			break;
 		}
-		if(readAtI((buf + cur_size), file_descriptors[fd]->last_block, fd) == -1)
+		size_t span = extent_size(id) - offset;
+		if (span > size - done)
 		{
-			break;
+			span = size - done;
+		}
+		if (span > (size_t)(my_file->size - pos))
+		{
+			span = my_file->size - pos;
 		}
-		cur_size ++;
+		views[count].data = extent + offset;
+		views[count].size = span;
+		count++;
+		done += span;
+		desc->read_write_pointer += span;
 	}
-	return cur_size;
+	pthread_rwlock_unlock(&my_file->lock);
+	pthread_mutex_unlock(&desc->position_lock);
+	return count;
 }
 
-void fully_delete_file(struct file *deleted_file)
+ssize_t
+ufs_seek(int fd, ssize_t offset, int whence)
 {
-	// printf("%s is getting fully deleted\n", deleted_file->file_name);
-	struct file *current = file_list;
-	while (current != NULL)
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc == NULL)
 	{
-		if (current->file_name == deleted_file->file_name && current->deleted)
-		{
-			if (current->next)
-			{
-				current->next->prev = current->prev;
-			}
-			if (current->prev)
-			{
-				current->prev->next = current->next;
-				if(current->next == current->prev)
-				{
-					printf("something wrong is happening\n");
-					printf("setting the next of %p with %p\n", current->prev, current->next);
-				}
-
-			}
-			if(!current->next && !current->prev){
-				file_list = NULL;
-			}
-			else if(current->prev == NULL)
-			{
-				file_list = current->next;
-			}
-			break;
-		}
-		if(current->next == current)
-		{
-			break;
-		}
-		current = current->next;
+		return -1;
 	}
-	struct block* current_block = deleted_file->block_list;
-	struct block* tmp;
-	while(current_block != NULL) {
-		tmp = current_block;
-		current_block = current_block->next;
-		if(tmp->memory != NULL)
-			free(tmp->memory);
-		free(tmp);
+	if (whence != UFS_SEEK_SET && whence != UFS_SEEK_CUR && whence != UFS_SEEK_END)
+	{
+		ufs_error_code = UFS_ERR_INVALID_ARGUMENT;
+		return -1;
+	}
+	pthread_mutex_lock(&desc->position_lock);
+	pthread_rwlock_rdlock(&desc->file->lock);
+	ssize_t base = 0;
+	if (whence == UFS_SEEK_CUR)
+	{
+		base = desc->read_write_pointer;
+	}
+	else if (whence == UFS_SEEK_END)
+	{
+		base = desc->file->size;
+	}
+	ssize_t rc = -1;
+	if (offset < -base || offset > MAX_FILE_SIZE - base)
+	{
+		ufs_error_code = UFS_ERR_INVALID_ARGUMENT;
+	}
+	else
+	{
+		desc->read_write_pointer = (int)(base + offset);
+		rc = desc->read_write_pointer;
 	}
+	pthread_rwlock_unlock(&desc->file->lock);
+	pthread_mutex_unlock(&desc->position_lock);
+	return rc;
+}
+
+void fully_delete_file(struct file *deleted_file)
+{
+	file_list_remove(deleted_file->deleted ? &deleted_file_list : &file_list, deleted_file);
+	file_truncate_extents(deleted_file, 0);
+	free(deleted_file->extents);
 	free(deleted_file->file_name);
+	pthread_rwlock_destroy(&deleted_file->lock);
 	free(deleted_file);
 }
 
 int ufs_close(int fd)
 {
-	if (fd > file_descriptor_capacity || fd < 0 || file_descriptors[fd] == NULL)
+	pthread_mutex_lock(&fs_lock);
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc == NULL)
 	{
-		ufs_error_code = UFS_ERR_NO_FILE;
+		pthread_mutex_unlock(&fs_lock);
 		return -1;
 	}
-	file_descriptors[fd]->file->refs_n -= 1;
-	if (!file_descriptors[fd]->file->refs_n && file_descriptors[fd]->file->deleted)
+	desc->file->refs_n -= 1;
+	if (!desc->file->refs_n && desc->file->deleted)
 	{
-		fully_delete_file(file_descriptors[fd]->file);
+		fully_delete_file(desc->file);
 	}
-	free(file_descriptors[fd]);
-	file_descriptors[fd] = NULL;
+	__atomic_store_n(&desc->file, NULL, __ATOMIC_RELEASE);
+	desc->next_free = first_free_fd;
+	first_free_fd = fd;
 	file_descriptor_count--;
+	pthread_mutex_unlock(&fs_lock);
 	return 0;
 }
 
 int ufs_delete(const char *filename)
 {
-	// printf("%s is getting partially deleted\n", filename);
+	pthread_mutex_lock(&fs_lock);
 	struct file *deleted_file = search_files_for(filename);
 	if(deleted_file == NULL) {
+		pthread_mutex_unlock(&fs_lock);
 		ufs_error_code = UFS_ERR_NO_FILE;
 		return -1;
 	}
+	// The name is free for a new file right away.
+	file_table_remove(deleted_file);
+	file_list_remove(&file_list, deleted_file);
 	deleted_file->deleted = 1;
+	file_list_add(&deleted_file_list, deleted_file);
 	if (deleted_file->refs_n == 0)
 	{
 		fully_delete_file(deleted_file);
 	}
+	pthread_mutex_unlock(&fs_lock);
 	return 0;
 }
 
 int ufs_resize(int fd, size_t new_size)
 {
-	if (fd >= file_descriptor_capacity 
-		|| fd < 0 || file_descriptors[fd] == NULL)
+	struct filedesc *desc = filedesc_get_writable(fd);
+	if (desc == NULL)
 	{
-		ufs_error_code = UFS_ERR_NO_FILE;
 		return -1;
 	}
 
-	if(file_descriptors[fd]->permissions&2)
-	{
-		ufs_error_code = UFS_ERR_NO_PERMISSION;
-		return -1;
-	}	
-
 	if((long long int) new_size > MAX_FILE_SIZE)
 	{
 		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
 	}
 
-	struct file* my_file = file_descriptors[fd]->file;
-
+	struct file* my_file = desc->file;
+	int rc = 0;
+	pthread_rwlock_wrlock(&my_file->lock);
 	if((int)new_size < my_file->size)
 	{
-		// Change all fd pointers to new_size -1;
-		// This doesn't handle new files that have the same name as partially deleted files.
 		my_file->size = (int)new_size;
-		int new_last_block_id = (int)new_size / BLOCK_SIZE;
-		struct block* new_last_block;
-		for(struct block* i = my_file->block_list; i != NULL; i++)
+		int offset;
+		file_truncate_extents(my_file, new_size > 0 ? extent_of(new_size - 1, &offset) + 1 : 0);
+		// Descriptors behind the new end proceed from it. The table is
+		// looked through without fs_lock, as by filedesc_get(), and the
+		// positions are not used by anyone while the file is locked.
+		int capacity = __atomic_load_n(&file_descriptor_capacity, __ATOMIC_ACQUIRE);
+		for(int i = 0; i < capacity; i++)
 		{
-			if(i->id == new_last_block_id)
+			struct filedesc *other = filedesc_at(i);
+			if(__atomic_load_n(&other->file, __ATOMIC_ACQUIRE) == my_file
+				&& (int)new_size < other->read_write_pointer)
 			{
-				new_last_block = i;
-				break;
+				other->read_write_pointer = (int) new_size;
 			}
 		}
-		for(int i = 0; i < file_descriptor_capacity; i++)
+	}
+	else if((int)new_size > my_file->size)
+	{
+		rc = file_grow(my_file, (int)new_size);
+	}
+	pthread_rwlock_unlock(&my_file->lock);
+	return rc;
+}
+
+/** Write the metadata into the copy which is not active, and make it active. */
+static int
+image_checkpoint(void)
+{
+	pthread_mutex_lock(&image.checkpoint_lock);
+	int copy = !image.sb->active;
+	uint64_t *bitmap = image_bitmap(copy);
+	struct image_inode *inodes = image_inodes(copy);
+	struct image_dirent *dirents = image_dirents(copy);
+	uint32_t count = 0;
+	pthread_mutex_lock(&fs_lock);
+	// The blocks of the new copy can not be taken by other files until it
+	// is written, even if they are freed meanwhile.
+	pthread_mutex_lock(&image.lock);
+	memset(bitmap, 0, (size_t)image.sb->bitmap_blocks * IMAGE_BLOCK_SIZE);
+	image.writing = copy;
+	pthread_mutex_unlock(&image.lock);
+	for (struct file *my_file = file_list; my_file != NULL; my_file = my_file->next)
+	{
+		pthread_rwlock_rdlock(&my_file->lock);
+		struct image_inode *inode = &inodes[count];
+		inode->size = my_file->size;
+		inode->number_of_extents = my_file->number_of_extents;
+		pthread_mutex_lock(&image.lock);
+		for (int i = 0; i < my_file->number_of_extents; i++)
 		{
-			if(file_descriptors[i] != NULL)
-			{
-				if(file_descriptors[i]->file->file_name == my_file->file_name)
-				{
-					if((int)new_size < file_descriptors[i]->read_write_pointer)
-					{
-						file_descriptors[i]->read_write_pointer = (int) new_size;
-					}
-					file_descriptors[i]->last_block = new_last_block;
-				}
-			}
+			inode->extents[i] = image_block_of(my_file->extents[i]);
+			image_blocks_mark(bitmap, inode->extents[i], image_extent_blocks(i), 1);
 		}
+		pthread_mutex_unlock(&image.lock);
+		pthread_rwlock_unlock(&my_file->lock);
+		strcpy(dirents[count].name, my_file->file_name);
+		dirents[count].inode = count;
+		dirents[count].reserved = 0;
+		count++;
+	}
+	pthread_mutex_unlock(&fs_lock);
+	// The data and the new copy are on disk before the superblock points
+	// at them. The whole mapping is synced, because a page can be bigger
+	// than a block. The superblock is not changed yet, so its page is
+	// written as it is.
+	int rc = msync(image.map, image.size, MS_SYNC);
+	pthread_mutex_lock(&image.lock);
+	if (rc == 0)
+	{
+		image.sb->file_count[copy] = count;
+		image.sb->generation++;
+		image.sb->active = copy;
+	}
+	image.writing = -1;
+	pthread_mutex_unlock(&image.lock);
+	if (rc == 0)
+	{
+		rc = msync(image.map, IMAGE_BLOCK_SIZE, MS_SYNC);
+	}
+	pthread_mutex_unlock(&image.checkpoint_lock);
+	return rc;
+}
 
+/** Lay out an empty image of the given number of blocks. */
+static int
+image_format(struct image_superblock *sb, size_t block_count)
+{
+	memset(sb, 0, sizeof(*sb));
+	sb->magic = IMAGE_MAGIC;
+	sb->version = IMAGE_VERSION;
+	sb->block_count = block_count;
+	sb->inode_count = block_count * IMAGE_BLOCK_SIZE / IMAGE_BYTES_PER_INODE;
+	if (sb->inode_count < IMAGE_MIN_INODES)
+	{
+		sb->inode_count = IMAGE_MIN_INODES;
 	}
-	else
+	// The bitmap could cover all the blocks, and has whole words.
+	sb->bitmap_blocks = (block_count + IMAGE_BLOCK_SIZE * 8 - 1) / (IMAGE_BLOCK_SIZE * 8);
+	sb->inode_blocks = ((size_t)sb->inode_count * sizeof(struct image_inode)
+		+ IMAGE_BLOCK_SIZE - 1) / IMAGE_BLOCK_SIZE;
+	uint32_t dirent_blocks = ((size_t)sb->inode_count * sizeof(struct image_dirent)
+		+ IMAGE_BLOCK_SIZE - 1) / IMAGE_BLOCK_SIZE;
+	uint32_t copy_blocks = sb->bitmap_blocks + sb->inode_blocks + dirent_blocks;
+	sb->copy_start[0] = 1;
+	sb->copy_start[1] = 1 + copy_blocks;
+	sb->data_start = 1 + 2 * copy_blocks;
+	if (sb->data_start + image_extent_blocks(GROWING_EXTENTS) > block_count)
 	{
-		// It's not necessary to add blocks that will be ignored anyway.
-		// Blocks will be added when necessary.
+		return -1;
+	}
+	sb->data_blocks = block_count - sb->data_start;
+	return 0;
+}
+
+/**
+ * Whether the superblock is of an image of this version and size. The layout
+ * has to be the one image_format() gives, or the metadata copies and the data
+ * could overlap or go beyond the file.
+ */
+static int
+image_superblock_is_valid(const struct image_superblock *sb, size_t file_size)
+{
+	struct image_superblock layout;
+	return sb->magic == IMAGE_MAGIC && sb->version == IMAGE_VERSION
+		&& (size_t)sb->block_count * IMAGE_BLOCK_SIZE <= file_size
+		&& image_format(&layout, sb->block_count) == 0
+		&& sb->inode_count == layout.inode_count
+		&& sb->copy_start[0] == layout.copy_start[0]
+		&& sb->copy_start[1] == layout.copy_start[1]
+		&& sb->bitmap_blocks == layout.bitmap_blocks
+		&& sb->inode_blocks == layout.inode_blocks
+		&& sb->data_start == layout.data_start
+		&& sb->data_blocks == layout.data_blocks
+		&& sb->active <= 1 && sb->file_count[sb->active] <= sb->inode_count;
+}
+
+/**
+ * Whether the file of the dirent fits in the image: the name ends within
+ * the dirent, the inode exists, and the extents are aligned runs of the data
+ * blocks, given to no other file. The extents are marked in the bitmap in
+ * memory.
+ */
+static int
+image_dirent_is_valid(const struct image_dirent *dirent)
+{
+	if (memchr(dirent->name, '\0', IMAGE_NAME_SIZE) == NULL
+		|| dirent->inode >= image.sb->inode_count)
+	{
+		return 0;
+	}
+	const struct image_inode *inode = &image_inodes(image.sb->active)[dirent->inode];
+	int offset;
+	if (inode->number_of_extents > MAX_NUMBER_OF_EXTENTS || inode->size > MAX_FILE_SIZE
+		|| (inode->size > 0 && extent_of(inode->size - 1, &offset) >= (int)inode->number_of_extents))
+	{
+		return 0;
+	}
+	for (uint32_t i = 0; i < inode->number_of_extents; i++)
+	{
+		uint32_t first = inode->extents[i];
+		uint32_t count = image_extent_blocks(i);
+		if (first % count != 0 || first >= image.sb->data_blocks
+			|| count > image.sb->data_blocks - first
+			|| image_blocks_are_used(image.used, first, count))
+		{
+			return 0;
+		}
+		image_blocks_mark(image.used, first, count, 1);
+	}
+	return 1;
+}
+
+/**
+ * Fill the file table from the active copy of the metadata. Returns -1 and
+ * loads nothing if the metadata does not fit in the image.
+ */
+static int
+image_load(void)
+{
+	int copy = image.sb->active;
+	struct image_inode *inodes = image_inodes(copy);
+	struct image_dirent *dirents = image_dirents(copy);
+	// The bitmap in memory is built anew from the extents, so the files can
+	// not share blocks.
+	memset(image.used, 0, (size_t)image.sb->bitmap_blocks * IMAGE_BLOCK_SIZE);
+	for (uint32_t i = 0; i < image.sb->file_count[copy]; i++)
+	{
+		if (!image_dirent_is_valid(&dirents[i]))
+		{
+			return -1;
+		}
+	}
+	for (uint32_t i = 0; i < image.sb->file_count[copy]; i++)
+	{
+		struct image_inode *inode = &inodes[dirents[i].inode];
+		struct file *my_file = file_new(dirents[i].name);
+		my_file->extent_capacity = inode->number_of_extents > 4 ? inode->number_of_extents : 4;
+		my_file->extents = malloc(my_file->extent_capacity * sizeof(char*));
+		for (uint32_t j = 0; j < inode->number_of_extents; j++)
+		{
+			my_file->extents[j] = image.data + (size_t)inode->extents[j] * IMAGE_BLOCK_SIZE;
+		}
+		my_file->number_of_extents = inode->number_of_extents;
+		my_file->size = inode->size;
+	}
+	return 0;
+}
+
+static void
+image_unmap(void)
+{
+	munmap(image.map, image.size);
+	close(image.fd);
+	free(image.used);
+	image.map = NULL;
+	image.sb = NULL;
+	image.data = NULL;
+	image.used = NULL;
+	image.fd = -1;
+	memset(image.next_slot, 0, sizeof(image.next_slot));
+}
+
+int
+ufs_mount(const char *path, size_t size)
+{
+	pthread_mutex_lock(&fs_lock);
+	if (image.map != NULL || file_list != NULL || deleted_file_list != NULL)
+	{
+		pthread_mutex_unlock(&fs_lock);
+		ufs_error_code = UFS_ERR_INVALID_ARGUMENT;
+		return -1;
+	}
+	image.fd = open(path, O_RDWR | O_CREAT, 0644);
+	struct stat st;
+	if (image.fd == -1 || fstat(image.fd, &st) != 0)
+	{
+		goto error;
+	}
+	int is_new = st.st_size == 0;
+	size_t block_count = (is_new ? size : (size_t)st.st_size) / IMAGE_BLOCK_SIZE;
+	if (block_count > UINT32_MAX)
+	{
+		goto error;
+	}
+	struct image_superblock sb;
+	if (is_new)
+	{
+		if (image_format(&sb, block_count) != 0
+			|| ftruncate(image.fd, block_count * IMAGE_BLOCK_SIZE) != 0)
+		{
+			goto error;
+		}
+	}
+	else if (pread(image.fd, &sb, sizeof(sb), 0) != sizeof(sb)
+		|| !image_superblock_is_valid(&sb, st.st_size))
+	{
+		goto error;
+	}
+	image.size = (size_t)sb.block_count * IMAGE_BLOCK_SIZE;
+	image.map = mmap(NULL, image.size, PROT_READ | PROT_WRITE, MAP_SHARED, image.fd, 0);
+	if (image.map == MAP_FAILED)
+	{
+		image.map = NULL;
+		goto error;
+	}
+	image.sb = (struct image_superblock *)image.map;
+	// The copies of a new image are zeros, so its active copy has no
+	// files, and it is usable right away once the superblock is written.
+	if (is_new)
+	{
+		*image.sb = sb;
+		if (msync(image.map, IMAGE_BLOCK_SIZE, MS_SYNC) != 0)
+		{
+			goto error;
+		}
+	}
+	image.data = image.map + (size_t)sb.data_start * IMAGE_BLOCK_SIZE;
+	image.used = malloc((size_t)sb.bitmap_blocks * IMAGE_BLOCK_SIZE);
+	if (image_load() != 0)
+	{
+		goto error;
+	}
+	pthread_mutex_unlock(&fs_lock);
+	return 0;
+
+error:
+	free(image.used);
+	image.used = NULL;
+	image.data = NULL;
+	image.sb = NULL;
+	if (image.map != NULL)
+	{
+		munmap(image.map, image.size);
+		image.map = NULL;
+	}
+	if (image.fd != -1)
+	{
+		close(image.fd);
+		image.fd = -1;
+	}
+	pthread_mutex_unlock(&fs_lock);
+	ufs_error_code = UFS_ERR_IO;
+	return -1;
+}
+
+int
+ufs_sync(void)
+{
+	if (image.map == NULL)
+	{
+		return 0;
+	}
+	if (image_checkpoint() != 0)
+	{
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
 	}
 	return 0;
 }
 
 void ufs_destroy(void)
 {
-	struct file* current_file = file_list;
-	while(current_file != NULL)
+	ufs_error_code = UFS_ERR_NO_ERR;
+	// The files of an image stay there, only the memory is freed.
+	if (image.map != NULL && image_checkpoint() != 0)
+	{
+		ufs_error_code = UFS_ERR_IO;
+	}
+	while (file_list != NULL)
+	{
+		fully_delete_file(file_list);
+	}
+	while (deleted_file_list != NULL)
 	{
-		struct file* tmp_file = current_file;
-		current_file = current_file->next;
-		fully_delete_file(tmp_file);
+		fully_delete_file(deleted_file_list);
 	}
-	
+	free(file_table);
+	file_table = NULL;
+	file_table_size = 0;
+	file_table_count = 0;
+
 	for(int i = 0; i < file_descriptor_capacity; i++)
 	{
-		free(file_descriptors[i]);
+		pthread_mutex_destroy(&filedesc_at(i)->position_lock);
+	}
+	for(int i = 0; i < MAX_FILE_DESCRIPTOR_SLABS; i++)
+	{
+		free(file_descriptor_slabs[i]);
+		file_descriptor_slabs[i] = NULL;
+	}
+	file_descriptor_count = 0;
+	file_descriptor_capacity = 0;
+
+	for (int i = 0; i < GROWING_EXTENTS; i++)
+	{
+		while (extent_pools[i].first != NULL)
+		{
+			char *extent = extent_pools[i].first;
+			extent_pools[i].first = *(char **)extent;
+			free(extent);
+		}
+		extent_pools[i].count = 0;
+	}
+	if (image.map != NULL)
+	{
+		image_unmap();
 	}
-	free(file_descriptors);
+	first_free_fd = -1;
 }
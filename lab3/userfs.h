@@ -1,6 +1,7 @@
 #pragma once
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #define NEED_OPEN_FLAGS
 #define NEED_RESIZE
 /**
@@ -8,6 +9,11 @@
  * Each file lies in the memory as an array of blocks. A file
  * has an unique file name, and there are no directories, so the
  * FS is a monolithic flat contiguous folder.
+ *
+ * The functions can be called from several threads at once. Different
+ * files are used in parallel, and so are reads of one file. The calls
+ * moving the position of a descriptor go one after another if several
+ * threads use it, while ufs_pread() and ufs_pwrite() go in parallel.
  */
 
 /**
@@ -66,9 +72,27 @@ enum ufs_error_code {
 
 	UFS_ERR_NO_PERMISSION,
 #endif
+	UFS_ERR_INVALID_ARGUMENT,
+	UFS_ERR_IO,
+};
+
+/** Where ufs_seek() counts the offset from. */
+enum ufs_seek_whence {
+	/** The file start. */
+	UFS_SEEK_SET,
+	/** The current position of the descriptor. */
+	UFS_SEEK_CUR,
+	/** The file end. */
+	UFS_SEEK_END,
+};
+
+/** A piece of the file memory given by ufs_read_view(). */
+struct ufs_view {
+	const char *data;
+	size_t size;
 };
 
-/** Get code of the last error. */
+/** Get code of the last error in the calling thread. */
 enum ufs_error_code
 ufs_errno();
 
@@ -113,6 +137,110 @@ ufs_write(int fd, const char *buf, size_t size);
 ssize_t
 ufs_read(int fd, char *buf, size_t size);
 
+/**
+ * Write data to the file at the offset. The position of the
+ * descriptor is not used and is not changed, so several users can
+ * share the descriptor. If the offset is beyond the file end, the
+ * gap is filled with zeros.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to write.
+ * @param size Size of @a buf.
+ * @param offset Offset in the file.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory, or the offset is beyond
+ *       the max file size.
+ */
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset);
+
+/**
+ * Read data from the file at the offset. The position of the
+ * descriptor is not used and is not changed.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to read into.
+ * @param size Maximum bytes to read.
+ * @param offset Offset in the file.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset);
+
+/**
+ * Move the position of the descriptor. It can be beyond the file
+ * end: reading there gives EOF, and writing fills the gap with zeros.
+ * @param fd File descriptor from ufs_open().
+ * @param offset Offset from the place given by @a whence.
+ * @param whence One of ufs_seek_whence.
+ *
+ * @retval >= 0 The new position.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARGUMENT - bad @a whence, or the position
+ *       would be negative or beyond the max file size.
+ */
+ssize_t
+ufs_seek(int fd, ssize_t offset, int whence);
+
+/**
+ * Write the buffers one after another, as one write. It is the same as
+ * ufs_write() of the buffers glued together.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to write.
+ * @param iovcnt Number of the buffers.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ *     - UFS_ERR_INVALID_ARGUMENT - negative @a iovcnt.
+ */
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Read data into the buffers, filling one after another. It is the
+ * same as ufs_read() into the buffers glued together.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to read into.
+ * @param iovcnt Number of the buffers.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARGUMENT - negative @a iovcnt.
+ */
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Read data without a copy. The views point right into the file
+ * memory, a view per piece of it which lies in one place. Up to
+ * @a size bytes are given, and the position moves by as many as the
+ * views cover. The views are valid until the next write, resize or
+ * close of the file, and see the data changed by writes of other
+ * threads.
+ * @param fd File descriptor from ufs_open().
+ * @param views Views to fill.
+ * @param view_count Maximum views to fill.
+ * @param size Maximum bytes to give.
+ *
+ * @retval > 0 How many views were filled.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARGUMENT - negative @a view_count.
+ */
+int
+ufs_read_view(int fd, struct ufs_view *views, int view_count, size_t size);
+
 /**
  * Close a file.
  * @param fd File descriptor from ufs_open().
@@ -164,10 +292,47 @@ ufs_resize(int fd, size_t new_size);
 
 #endif
 
+/**
+ * Keep the filesystem in the image file at the path, mapped into memory,
+ * so the files outlive the process. If the file is empty or does not
+ * exist, an empty image of @a size bytes is made there. Otherwise the
+ * files of the image are opened as they were at its last checkpoint, and
+ * @a size is not used. Must be called when there are no files.
+ *
+ * The data is written right into the image. The files, their sizes and
+ * blocks are written by a checkpoint: ufs_sync() or ufs_destroy(). A
+ * crash keeps the files of the last checkpoint. In an image a file name is
+ * shorter than 56 bytes, and there is a file per 64 KB of the image.
+ * @param path Image file.
+ * @param size Size of a new image.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARGUMENT - an image is already used, or there
+ *       are files.
+ *     - UFS_ERR_IO - the file can not be used, is not an image, or
+ *       @a size is too small for one.
+ */
+int
+ufs_mount(const char *path, size_t size);
+
+/**
+ * Make a checkpoint of the image, if there is one.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_IO - the image could not be written.
+ */
+int
+ufs_sync(void);
+
 /**
  * Destroy all the global variables, free all the memory, close and delete all
  * the files. After the destruction neither of the ufs functions are supposed to
  * be used. Purpose of the destruction is to reclaim all the dynamic memory.
+ * No other ufs function may run at the same time. With an image, a
+ * checkpoint is made, the image is closed and its files stay in it. If
+ * the checkpoint fails, ufs_errno() is UFS_ERR_IO, and the image keeps
+ * the files of the checkpoint before.
  */
 void
 ufs_destroy(void);
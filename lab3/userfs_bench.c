@@ -0,0 +1,386 @@
+#include "userfs.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Throughput benchmark of userfs. A file is written and then read back by
+ * operations of 1 KB, 64 KB and 10 MB, and the speed of each is reported in
+ * MB/s. The same amount of data goes through each operation size.
+ *
+ * Then a file is written by 16 byte headers with 4 KB payloads, by two
+ * writes and by one writev, and is read by 64 KB views without a copy.
+ *
+ * Then a file of the same size is read by 4 KB preads at random offsets.
+ *
+ * Then 1, 2, 4 and 8 threads write files of their own by 64 KB, and read a
+ * shared file by 4 KB preads at random offsets, and the total speed of all
+ * threads is reported.
+ *
+ * Then many distinct files are created and kept open, opened again by name,
+ * closed and deleted, and the operations per second are reported.
+ *
+ * Then files are created, written with 100 KB or 3 MB, closed and deleted in
+ * a loop, and the cycles per second are reported.
+ *
+ * At last a tenth of the file count of 4 KB files is written into an image
+ * file, and the time of a checkpoint and of mounting the image again is
+ * reported.
+ *
+ * Usage: ./userfs_bench [data size in MB, up to 100] [file count]
+ */
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench_op_size(const char *name, size_t op_size, size_t total, char *buf)
+{
+	size_t op_count = total / op_size;
+	int fd = ufs_open("bench", UFS_CREATE);
+	if (fd == -1) {
+		fprintf(stderr, "open failed: %d\n", ufs_errno());
+		exit(1);
+	}
+	double start = now();
+	for (size_t i = 0; i < op_count; ++i) {
+		if (ufs_write(fd, buf, op_size) != (ssize_t)op_size) {
+			fprintf(stderr, "write failed: %d\n", ufs_errno());
+			exit(1);
+		}
+	}
+	double write_time = now() - start;
+	ufs_close(fd);
+
+	fd = ufs_open("bench", 0);
+	start = now();
+	for (size_t i = 0; i < op_count; ++i) {
+		if (ufs_read(fd, buf, op_size) != (ssize_t)op_size) {
+			fprintf(stderr, "read failed: %d\n", ufs_errno());
+			exit(1);
+		}
+	}
+	double read_time = now() - start;
+	ufs_close(fd);
+	ufs_delete("bench");
+
+	double mb = (double)(op_count * op_size) / (1024 * 1024);
+	printf("%-8s write %10.1f MB/s   read %10.1f MB/s\n", name,
+	       mb / write_time, mb / read_time);
+}
+
+static void
+bench_vectors(size_t total, char *buf)
+{
+	enum { HEADER_SIZE = 16, PAYLOAD_SIZE = 4096, VIEW_SIZE = 64 * 1024 };
+	size_t op_count = total / (HEADER_SIZE + PAYLOAD_SIZE);
+	struct iovec iov[] = {{buf, HEADER_SIZE}, {buf, PAYLOAD_SIZE}};
+	int fd = ufs_open("bench", UFS_CREATE);
+	double start = now();
+	for (size_t i = 0; i < op_count; ++i) {
+		if (ufs_write(fd, buf, HEADER_SIZE) != HEADER_SIZE ||
+		    ufs_write(fd, buf, PAYLOAD_SIZE) != PAYLOAD_SIZE) {
+			fprintf(stderr, "write failed: %d\n", ufs_errno());
+			exit(1);
+		}
+	}
+	double write_time = now() - start;
+	/* A new file, so both write into fresh memory. */
+	ufs_close(fd);
+	ufs_delete("bench");
+	fd = ufs_open("bench", UFS_CREATE);
+	start = now();
+	for (size_t i = 0; i < op_count; ++i) {
+		if (ufs_writev(fd, iov, 2) != HEADER_SIZE + PAYLOAD_SIZE) {
+			fprintf(stderr, "writev failed: %d\n", ufs_errno());
+			exit(1);
+		}
+	}
+	double writev_time = now() - start;
+	ufs_seek(fd, 0, UFS_SEEK_SET);
+	struct ufs_view views[4];
+	size_t sum = 0;
+	start = now();
+	int count;
+	while ((count = ufs_read_view(fd, views, 4, VIEW_SIZE)) > 0) {
+		for (int i = 0; i < count; ++i)
+			sum += views[i].data[views[i].size - 1];
+	}
+	double view_time = now() - start;
+	ufs_close(fd);
+	ufs_delete("bench");
+
+	double mb = (double)op_count * (HEADER_SIZE + PAYLOAD_SIZE) /
+		    (1024 * 1024);
+	printf("%-8s write %10.1f MB/s   writev %9.1f MB/s\n", "hdr+4K",
+	       mb / write_time, mb / writev_time);
+	printf("%-8s view  %10.1f MB/s   (%zu)\n", "64 KB", mb / view_time,
+	       sum % 10);
+}
+
+static void
+bench_random_pread(size_t total, char *buf)
+{
+	enum { OP_SIZE = 4096 };
+	int fd = ufs_open("bench", UFS_CREATE);
+	if (fd == -1 || ufs_resize(fd, total) != 0) {
+		fprintf(stderr, "resize failed: %d\n", ufs_errno());
+		exit(1);
+	}
+	int op_count = total / OP_SIZE;
+	unsigned seed = 1;
+	double start = now();
+	for (int i = 0; i < op_count; ++i) {
+		size_t offset = rand_r(&seed) % (total - OP_SIZE);
+		if (ufs_pread(fd, buf, OP_SIZE, offset) != OP_SIZE) {
+			fprintf(stderr, "pread failed: %d\n", ufs_errno());
+			exit(1);
+		}
+	}
+	double time = now() - start;
+	ufs_close(fd);
+	ufs_delete("bench");
+	printf("%-8s %10.0f ops/s  %10.1f MB/s\n", "pread 4K", op_count / time,
+	       (double)op_count * OP_SIZE / (1024 * 1024) / time);
+}
+
+/**
+ * The threads start each phase together at the barrier. A phase takes from
+ * the earliest start to the latest finish among the threads.
+ */
+struct bench_thread {
+	int id;
+	int shared_fd;
+	size_t size;
+	pthread_barrier_t *barrier;
+	double write_start;
+	double write_end;
+	double read_start;
+	double read_end;
+};
+
+static void *
+bench_thread_f(void *arg)
+{
+	enum { WRITE_SIZE = 64 * 1024, READ_SIZE = 4096 };
+	struct bench_thread *ctx = arg;
+	char *buf = malloc(WRITE_SIZE);
+	memset(buf, 'a' + ctx->id, WRITE_SIZE);
+	char name[32];
+	sprintf(name, "bench%d", ctx->id);
+	int fd = ufs_open(name, UFS_CREATE);
+	pthread_barrier_wait(ctx->barrier);
+	ctx->write_start = now();
+	for (size_t done = 0; done < ctx->size; done += WRITE_SIZE) {
+		if (ufs_write(fd, buf, WRITE_SIZE) != WRITE_SIZE) {
+			fprintf(stderr, "write failed: %d\n", ufs_errno());
+			exit(1);
+		}
+	}
+	ctx->write_end = now();
+	ufs_close(fd);
+	ufs_delete(name);
+	pthread_barrier_wait(ctx->barrier);
+
+	unsigned seed = ctx->id + 1;
+	ctx->read_start = now();
+	for (size_t done = 0; done < ctx->size; done += READ_SIZE) {
+		size_t offset = rand_r(&seed) % (ctx->size - READ_SIZE);
+		if (ufs_pread(ctx->shared_fd, buf, READ_SIZE, offset) != READ_SIZE) {
+			fprintf(stderr, "pread failed: %d\n", ufs_errno());
+			exit(1);
+		}
+	}
+	ctx->read_end = now();
+	free(buf);
+	return NULL;
+}
+
+static void
+bench_threads(int thread_count, size_t total)
+{
+	struct bench_thread ctx[thread_count];
+	pthread_t threads[thread_count];
+	int fd = ufs_open("shared", UFS_CREATE);
+	if (fd == -1 || ufs_resize(fd, total) != 0) {
+		fprintf(stderr, "resize failed: %d\n", ufs_errno());
+		exit(1);
+	}
+	pthread_barrier_t barrier;
+	pthread_barrier_init(&barrier, NULL, thread_count);
+	/* Each thread moves the whole amount, each file is of its own. */
+	for (int i = 0; i < thread_count; ++i) {
+		ctx[i].id = i;
+		ctx[i].shared_fd = fd;
+		ctx[i].size = total;
+		ctx[i].barrier = &barrier;
+		pthread_create(&threads[i], NULL, bench_thread_f, &ctx[i]);
+	}
+	for (int i = 0; i < thread_count; ++i)
+		pthread_join(threads[i], NULL);
+	pthread_barrier_destroy(&barrier);
+	double write_start = ctx[0].write_start, write_end = ctx[0].write_end;
+	double read_start = ctx[0].read_start, read_end = ctx[0].read_end;
+	for (int i = 1; i < thread_count; ++i) {
+		if (ctx[i].write_start < write_start)
+			write_start = ctx[i].write_start;
+		if (ctx[i].write_end > write_end)
+			write_end = ctx[i].write_end;
+		if (ctx[i].read_start < read_start)
+			read_start = ctx[i].read_start;
+		if (ctx[i].read_end > read_end)
+			read_end = ctx[i].read_end;
+	}
+	double write_time = write_end - write_start;
+	double read_time = read_end - read_start;
+	ufs_close(fd);
+	ufs_delete("shared");
+	double mb = (double)total * thread_count / (1024 * 1024);
+	printf("%d thr    write %10.1f MB/s   pread %9.1f MB/s\n", thread_count,
+	       mb / write_time, mb / read_time);
+}
+
+static void
+report_ops(const char *name, int count, double start)
+{
+	printf("%-10s %10.0f ops/s\n", name, count / (now() - start));
+}
+
+static void
+bench_files(int count)
+{
+	int *fds = malloc(count * sizeof(*fds));
+	char name[32];
+	double start = now();
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		fds[i] = ufs_open(name, UFS_CREATE);
+		if (fds[i] == -1) {
+			fprintf(stderr, "open failed: %d\n", ufs_errno());
+			exit(1);
+		}
+	}
+	report_ops("create", count, start);
+	start = now();
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, 0);
+		if (fd == -1 || ufs_close(fd) != 0) {
+			fprintf(stderr, "reopen failed: %d\n", ufs_errno());
+			exit(1);
+		}
+	}
+	report_ops("reopen", count, start);
+	start = now();
+	for (int i = 0; i < count; ++i)
+		ufs_close(fds[i]);
+	report_ops("close", count, start);
+	start = now();
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		if (ufs_delete(name) != 0) {
+			fprintf(stderr, "delete failed: %d\n", ufs_errno());
+			exit(1);
+		}
+	}
+	report_ops("delete", count, start);
+	free(fds);
+}
+
+static void
+bench_churn(const char *name, int count, int size, char *buf)
+{
+	double start = now();
+	for (int i = 0; i < count; ++i) {
+		int fd = ufs_open("churn", UFS_CREATE);
+		if (fd == -1 || ufs_write(fd, buf, size) != size) {
+			fprintf(stderr, "churn failed: %d\n", ufs_errno());
+			exit(1);
+		}
+		ufs_close(fd);
+		ufs_delete("churn");
+	}
+	report_ops(name, count, start);
+}
+
+static void
+bench_image(int count, char *buf)
+{
+	const char *path = "userfs_bench.img";
+	unlink(path);
+	/* Twice the inodes needed, there is one per 64 KB. */
+	size_t size = (size_t)count * 128 * 1024 + 64 * 1024 * 1024;
+	if (ufs_mount(path, size) != 0) {
+		fprintf(stderr, "mount failed: %d\n", ufs_errno());
+		exit(1);
+	}
+	char name[32];
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd == -1 || ufs_write(fd, buf, 4096) != 4096) {
+			fprintf(stderr, "image write failed: %d\n", ufs_errno());
+			exit(1);
+		}
+		ufs_close(fd);
+	}
+	double start = now();
+	if (ufs_sync() != 0) {
+		fprintf(stderr, "sync failed: %d\n", ufs_errno());
+		exit(1);
+	}
+	double sync_time = now() - start;
+	ufs_destroy();
+	start = now();
+	if (ufs_mount(path, 0) != 0) {
+		fprintf(stderr, "mount failed: %d\n", ufs_errno());
+		exit(1);
+	}
+	double mount_time = now() - start;
+	ufs_destroy();
+	unlink(path);
+	printf("image    %d files: sync %.1f ms, mount %.1f ms\n", count,
+	       sync_time * 1000, mount_time * 1000);
+}
+
+int
+main(int argc, char **argv)
+{
+	int mb = argc > 1 ? atoi(argv[1]) : 80;
+	int file_count = argc > 2 ? atoi(argv[2]) : 100000;
+	if (mb < 10 || mb > 100 || file_count < 1) {
+		fprintf(stderr, "Usage: %s [data size in MB, 10..100] "
+			"[file count]\n", argv[0]);
+		return 2;
+	}
+	size_t total = (size_t)mb * 1024 * 1024;
+	size_t max_op = 10 * 1024 * 1024;
+	char *buf = malloc(max_op);
+	for (size_t i = 0; i < max_op; ++i)
+		buf[i] = 'a' + i % 26;
+
+	bench_op_size("1 KB", 1024, total, buf);
+	bench_op_size("64 KB", 64 * 1024, total, buf);
+	bench_op_size("10 MB", max_op, total, buf);
+	bench_vectors(total, buf);
+	bench_random_pread(total, buf);
+	for (int threads = 1; threads <= 8; threads *= 2)
+		bench_threads(threads, total / 4);
+
+	bench_files(file_count);
+	bench_churn("churn 100K", file_count, 100 * 1024, buf);
+	bench_churn("churn 3M", file_count / 10 + 1, 3 * 1024 * 1024, buf);
+	bench_image(file_count / 10 + 1, buf);
+	free(buf);
+	ufs_destroy();
+	return 0;
+}